@@ -40,7 +40,10 @@
  * Complex strings are quoted with ''.
  * Very complex strings are quoted with $''.
  *
- * Note that the name is allocated on the stack, so for extreme long names we will still run OOM.
+ * Note that the name is kept in memory, so for extreme long names we will still run OOM.
+ * For untrusted input use --max-key, --max-name, --max-depth and --max-heap.
+ * Names are kept in one buffer per nesting level, which grows in BUFSIZ steps,
+ * so memory is bounded by the limits:  about depth * (key + BUFSIZ) plus the I/O buffers.
  */
 
 #include <stdio.h>
@@ -49,6 +52,27 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <pthread.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #define	NAME	"json2sh"
 #include "VERSION.h"
@@ -56,6 +80,15 @@
 static int	line;
 static int	column;
 static struct _buf *PREF, *SEP, *LF;
+static int	pipelined;
+static int	raw;		/* --raw records instead of shell lines	*/
+static int	check;		/* --check only validates	*/
+static unsigned long	values;		/* number of values output	*/
+static struct { unsigned long values, elements; int tail; unsigned long key, name, depth; } limit;
+static struct { size_t used, peak, max; int stats; } MEM;
+static unsigned long	depth;		/* nesting of containers	*/
+static jmp_buf		*oops_jmp;	/* OOPS() returns here instead of exiting	*/
+static int		oops;		/* output is flushed on the first OOPS() only	*/
 
 #if 0
 #define	D(...)	debug_printf(__FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
@@ -77,20 +110,48 @@ static int cc(char c) { return c<0 || !isprint(c) ? '?' : c; }
 #endif
 #define	xD(...)	do {} while (0)
 
+/* Static tracepoints (USDT) for bpftrace, perf or systemtap, like:
+ *	bpftrace -e 'usdt:./json2sh:json2sh:value__end { @[arg0] = count(); }'
+ * They are a NOP until attached.
+ * Compiled in if <sys/sdt.h> is available, unless NO_SDT is defined.
+ */
+#if defined(__has_include) && !defined(NO_SDT)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define	PROBE2(N,A,B)		DTRACE_PROBE2(json2sh, N, A, B)
+#define	PROBE3(N,A,B,C)		DTRACE_PROBE3(json2sh, N, A, B, C)
+#endif
+#endif
+#ifndef	PROBE2
+#define	PROBE2(N,A,B)		do {} while (0)
+#define	PROBE3(N,A,B,C)		do {} while (0)
+#endif
+
 /**********************************************************************
  * OUTPUT
  *********************************************************************/
 
 #define	FATAL(X)	do { if (X) OOPS("FATAL ERROR %s:%d:%s: %s", __FILE__, __LINE__, __FUNCTION__, #X); } while (0)
 
+static void out_flush(void);
+static void wr_sync(void);
+static void in_pos(void);
+static void diff_abort(void);
+
 static void
 OOPS(const char *s, ...)
 {
-  int	e=errno;
+  int		e=errno;
 
   va_list	list;
 
-  fflush(stdout);
+  if (!oops++)
+    {
+      out_flush();
+      wr_sync();
+    }
+  in_pos();
+  PROBE3(oops, line+1, column+1, s);
 
   fprintf(stderr, NAME ":%d:%d: ", line+1, column+1);
   va_start(list, s);
@@ -102,6 +163,9 @@ OOPS(const char *s, ...)
   perror(NULL);
   fflush(stderr);
 
+  if (oops_jmp)
+    longjmp(*oops_jmp, 1);
+  diff_abort();
   exit(23);
 }
 
@@ -111,16 +175,134 @@ OOPSc(int c, const char *s)
   OOPS("%s with character %c (%02x)", s, isprint(c) ? c : ' ', c);
 }
 
+/* Output goes to sinks, each with its own buffer.
+ * Usually there is only one, stdout.
+ * The discard sink swallows output until we know where it belongs.
+ * A sink which grows collects whole lines and passes them to eol().
+ */
+struct sink
+  {
+    struct sink	*next;
+    const char	*name;
+    int		fd;		/* -1: discard	*/
+    int		open;		/* line started, which needs LF	*/
+    int		grow;		/* grow buffer instead of flush	*/
+    void	(*eol)(struct sink *);	/* called after LF	*/
+    size_t	fill, size;
+    size_t	mark;		/* position of SEP	*/
+    char	*buf;
+  };
+
+static struct sink	stdsink = { NULL, "-", 1 }, discard = { NULL, NULL, -1 };
+static struct sink	*OUT = &stdsink, *sinks = &stdsink;
+
+static void *alloc0(size_t len);
+static void *re_alloc(void *buf, size_t len);
+static char *wr_queue(int fd, const char *name, char *buf, size_t len);
+
+static void
+sink_out(struct sink *s, const char *buf, size_t len)
+{
+  size_t	pos;
+
+  if (s->fd < 0)
+    return;
+  wr_sync();
+  for (pos=0; pos<len; )
+    {
+      ssize_t	got;
+
+      got	= write(s->fd, buf+pos, len-pos);
+      if (got>0)
+        pos	+= got;
+      else if (!got || errno!=EINTR)
+        OOPS("write error on %s", s->name);
+    }
+}
+
+static void
+sink_flush(struct sink *s)
+{
+  size_t	len;
+
+  len		= s->fill;
+  s->fill	= 0;
+  PROBE2(output__flush, s->fd, len);
+  if (pipelined && s->fd>=0 && !s->grow && len)
+    s->buf	= wr_queue(s->fd, s->name, s->buf, len);
+  else
+    sink_out(s, s->buf, len);
+}
+
+/* Make room in the buffer
+ */
+static void
+sink_room(struct sink *s)
+{
+  if (!s->size)
+    {
+      s->buf	= alloc0(BUFSIZ*8);
+      s->size	= BUFSIZ*8;
+    }
+  else if (s->grow)
+    {
+      s->buf	=  re_alloc(s->buf, s->size*2);
+      s->size	*= 2;
+    }
+  else
+    sink_flush(s);
+}
+
+/* Big chunks bypass the buffer
+ */
+static void
+sink_write(struct sink *s, const char *buf, size_t len)
+{
+  s->open	= 1;
+  if (len >= BUFSIZ*8 && !s->grow)
+    {
+      sink_flush(s);
+      sink_out(s, buf, len);
+      return;
+    }
+  while (len)
+    {
+      size_t	max;
+
+      if (s->fill >= s->size)
+        sink_room(s);
+      max	= s->size - s->fill;
+      if (max > len)
+        max	= len;
+      memcpy(s->buf+s->fill, buf, max);
+      s->fill	+= max;
+      buf	+= max;
+      len	-= max;
+    }
+}
+
+static void
+out_flush(void)
+{
+  struct sink	*s;
+
+  for (s=sinks; s; s=s->next)
+    sink_flush(s);
+}
+
 static void
 outc(char c)
 {
-  putchar(c);
+  if (OUT->fill >= OUT->size)
+    sink_room(OUT);
+  OUT->buf[OUT->fill++]	= c;
+  OUT->open		= 1;
 }
 
 static void
 outn(const char *s, size_t len)
 {
-  fwrite(s, len, 1, stdout);
+  sink_write(OUT, s, len);
 }
 
 #if 0
@@ -132,17 +314,100 @@ out(const char *s)
 #endif
 
 static void outb(struct _buf *b);
+static void (*out_LF)(void);
 
+/* Terminate the line of the current sink.
+ * Lines are terminated lazily, so each sink knows for itself.
+ */
 static void
 nl(void)
 {
-  outb(LF);
+  if (!OUT->open)
+    return;
+  out_LF();
+  OUT->open	= 0;
+  if (OUT->eol)
+    OUT->eol(OUT);
+}
+
+/* --assoc N and --declare N output few big statements instead of a line per value,
+ * as bash spends most of the time parsing when sourcing big documents.
+ * Each statement gets at most N entries, so bash does not need to hold too much.
+ */
+static struct
+  {
+    unsigned long	max, count;
+    int			assoc, pending;
+    struct _buf		*name;		/* array name for --assoc	*/
+  } bulk;
+
+static void
+bulk_begin(void)
+{
+  bulk.pending	= 0;
+  if (!bulk.assoc)
+    outn("declare ", 8);
+  else if (!bulk.count)
+    {
+      outn("declare -A ", 11);
+      outb(bulk.name);
+      outn("=(\n", 3);
+    }
+  else
+    {
+      outb(bulk.name);
+      outn("+=(\n", 4);
+    }
+}
+
+static void
+bulk_end(void)
+{
+  if (bulk.assoc)
+    outn(")\n", 2);
+  else
+    outc('\n');
+  OUT->open	= 0;
+}
+
+/* Called after each entry.
+ * The next statement is started lazily, as an empty declare would list all variables.
+ */
+static void
+bulk_eol(struct sink *s)
+{
+  if (++bulk.count % bulk.max)
+    return;
+  bulk_end();
+  bulk.pending	= 1;
 }
 
+static void *alloc0(size_t len);
+static void mem_free(void *buf);
+
+/* Longer output is formatted again into a buffer which fits
+ */
 static void
 vout(const char *s, va_list list)
 {
-  vprintf(s, list);
+  char		tmp[BUFSIZ], *buf;
+  va_list	again;
+  int		len;
+
+  va_copy(again, list);
+  len	= vsnprintf(tmp, sizeof tmp, s, list);
+  if (len<0)
+    OOPS("cannot format output");
+  if (len<sizeof tmp)
+    outn(tmp, len);
+  else
+    {
+      buf	= alloc0(len+1);
+      vsnprintf(buf, len+1, s, again);
+      outn(buf, len);
+      mem_free(buf);
+    }
+  va_end(again);
 }
 
 static void
@@ -303,30 +568,156 @@ outb(struct _buf *b)
   outn(b->buf, b->len);
 }
 
+/* SEP and LF are output for each value.
+ * Nearly always they are empty or a single character (like '=' and '\n' or NUL),
+ * so specialized emitters are selected once at startup.
+ * The generic outb() stays for everything longer.
+ */
+#define	EMITTER(X)						\
+static char	X##_c;						\
+static void	X##_0(void) { }					\
+static void	X##_1(void) { outc(X##_c); }			\
+static void	X##_n(void) { outb(X); }			\
+static void	(*out_##X)(void) = X##_n;			\
+static void							\
+X##_emitter(void)						\
+{								\
+  X##_c		= X->len ? X->buf[0] : 0;			\
+  out_##X	= X->len==0 ? X##_0 : X->len==1 ? X##_1 : X##_n;	\
+}
+
+EMITTER(SEP)
+EMITTER(LF)
+
+/* All memory is allocated here, so it can be accounted and limited.
+ * Each allocation carries its size in front.
+ */
+union mem
+  {
+    size_t	len;
+    long double	align;
+  };
+
+/* Check before allocating and count after, so a failed request is not kept
+ */
+static void
+mem_check(size_t old, size_t len)
+{
+  if (MEM.max && len > old && MEM.used + (len - old) > MEM.max)
+    OOPS("memory limit of %zu bytes exceeded (%zu bytes requested)", MEM.max, len);
+}
+
+static void
+mem_account(size_t old, size_t len)
+{
+  MEM.used	+= len - old;
+  if (MEM.peak < MEM.used)
+    MEM.peak	= MEM.used;
+}
+
 static void *
 alloc0(size_t len)
 {
-  void	*ptr;
+  union mem	*ptr;
 
   if (!len)
     len	= 1;
-  ptr	= calloc(1, len);
+  mem_check(0, len);
+  ptr	= calloc(1, sizeof *ptr + len);
   if (!ptr)
     OOPS("out of memory");
-  return ptr;
+  mem_account(0, len);
+  ptr->len	= len;
+  return ptr+1;
 }
 
 static void *
 re_alloc(void *buf, size_t len)
 {
-  void	*ptr;
+  union mem	*ptr = buf;
 
+  if (!buf)
+    return alloc0(len);
   if (!len)
     len	= 1;
-  ptr	= realloc(buf, len);
+  ptr--;
+  mem_check(ptr->len, len);
+  ptr	= realloc(ptr, sizeof *ptr + len);
   if (!ptr)
     OOPS("out of memory");
-  return ptr;
+  mem_account(ptr->len, len);
+  ptr->len	= len;
+  return ptr+1;
+}
+
+static void
+mem_free(void *buf)
+{
+  union mem	*ptr = buf;
+
+  if (!buf)
+    return;
+  ptr--;
+  mem_account(ptr->len, 0);
+  free(ptr);
+}
+
+/* Buffer which grows as needed
+ */
+struct gbuf
+  {
+    char	*buf;
+    size_t	len, max;
+  };
+
+static void
+gbuf_grow(struct gbuf *b, size_t len)
+{
+  size_t	max = (b->len+len+BUFSIZ) / BUFSIZ * BUFSIZ;
+
+  if (b->len+len > b->max)
+    {
+      b->buf	= re_alloc(b->buf, max);
+      b->max	= max;
+    }
+}
+
+static void
+gbuf_put(struct gbuf *b, const char *s, size_t len)
+{
+  gbuf_grow(b, len);
+  memcpy(b->buf+b->len, s, len);
+  b->len	+= len;
+}
+
+/* Encode a codepoint as UTF-8, returns the length
+ */
+static int
+utf8(char *s, unsigned c)
+{
+  if (c<0x80)
+    {
+      s[0]	= c;
+      return 1;
+    }
+  if (c<0x800)
+    {
+      s[0]	= 0xc0 | (c>>6);
+      s[1]	= 0x80 | (c&0x3f);
+      return 2;
+    }
+  if (c<0x10000)
+    {
+      s[0]	= 0xe0 | (c>>12);
+      s[1]	= 0x80 | ((c>>6)&0x3f);
+      s[2]	= 0x80 | (c&0x3f);
+      return 3;
+    }
+  s[0]	= 0xf0 | ((c>>18)&7);
+  s[1]	= 0x80 | ((c>>12)&0x3f);
+  s[2]	= 0x80 | ((c>>6)&0x3f);
+  s[3]	= 0x80 | (c&0x3f);
+  return 4;
 }
 
 struct _buf *
@@ -349,121 +740,661 @@ buf(const char *s)
   return b;
 }
 
+static void
+buf_free(struct _buf *b)
+{
+  if (!b)
+    return;
+  mem_free((char *)b->buf);
+  mem_free(b);
+}
 
 /**********************************************************************
- * INPUT
+ * Vectorized kernels
  *********************************************************************/
 
-static int
-get(void)
+/* The hot loops are done by kernels, which return the number of
+ * leading bytes which belong to some character class.
+ * There are variants for several instruction sets in the binary,
+ * the best one the CPU supports is selected once at startup.
+ * Set JSON2SH_ISA=scalar|sse42|avx2|avx512 to force a variant.
+ * All variants must give identical results.
+ */
+enum kern_class
+  {
+    K_WS	= 1,	/* whitespace as isspace()	*/
+    K_STR	= 2,	/* string bytes which need no unescaping	*/
+    K_SIMPLE	= 4,	/* 0-9 A-Z a-z	*/
+    K_QUOTE1	= 8,	/* can go into '' quotes	*/
+    K_QUOTE3	= 16,	/* can go into $'' quotes unescaped	*/
+    K_DIGIT	= 32,	/* 0-9	*/
+  };
+
+typedef size_t kern_fn(const unsigned char *, size_t);
+
+static struct kern
+  {
+    const char	*name;
+    kern_fn	*ws, *str, *simple, *quote1, *quote3, *digit;
+  } K;
+
+static unsigned char	kern_cls[256];
+
+static void
+kern_table(void)
 {
   int	c;
 
-  if ((c=getchar()) == '\n')
-    {
-      line++;
-      column=0;
-    }
-  else if (c != EOF)
-    column++;
-  xD("(%d %c)", c, cc(c));
-  return c;
+  for (c=0; c<256; c++)
+    kern_cls[c]	= (isspace(c) ? K_WS : 0)
+                  | (c!='"' && c!='\\' ? K_STR : 0)
+                  | (isdigit(c) || (c>='A' && c<='Z') || (c>='a' && c<='z') ? K_SIMPLE : 0)
+                  | (c>=32 && c!='\'' && c!=127 ? K_QUOTE1 : 0)
+                  | (c>=32 && c!='\'' && c!='\\' && c!=127 ? K_QUOTE3 : 0)
+                  | (isdigit(c) ? K_DIGIT : 0);
 }
 
-static int
-next(void)
-{
-  int	c;
+#define	KERN_SCALAR(NAME, CLS)					\
+static size_t							\
+NAME##_scalar(const unsigned char *p, size_t n)			\
+{								\
+  size_t	i;						\
+								\
+  for (i=0; i<n && (kern_cls[p[i]] & CLS); i++);		\
+  return i;							\
+}
 
-  while ((c = get()) != EOF && isspace(c));
-  return c;
+KERN_SCALAR(ws,		K_WS)
+KERN_SCALAR(str,	K_STR)
+KERN_SCALAR(simple,	K_SIMPLE)
+KERN_SCALAR(quote1,	K_QUOTE1)
+KERN_SCALAR(quote3,	K_QUOTE3)
+KERN_SCALAR(digit,	K_DIGIT)
+
+static const struct kern kern_scalar = { "scalar", ws_scalar, str_scalar, simple_scalar, quote1_scalar, quote3_scalar, digit_scalar };
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define	KERN_X86
+
+/* SSE4.2: PCMPESTRI with ranges or sets.
+ * NEG: first byte outside of the ranges, ANY: first byte of the set.
+ */
+#define	KERN_SSE42(NAME, SET, MODE)				\
+static size_t __attribute__((target("sse4.2")))		\
+NAME##_sse42(const unsigned char *p, size_t n)			\
+{								\
+  static const char	set[16] = SET;				\
+  const __m128i		s = _mm_loadu_si128((const __m128i *)set);	\
+  size_t		i;					\
+  int			x;					\
+								\
+  for (i=0; i+16<=n; i+=16)					\
+    if ((x = _mm_cmpestri(s, sizeof SET-1, _mm_loadu_si128((const __m128i *)(p+i)), 16, _SIDD_UBYTE_OPS|MODE))<16)	\
+      return i+x;						\
+  return i + NAME##_scalar(p+i, n-i);				\
 }
+#define	NEG	(_SIDD_CMP_RANGES|_SIDD_NEGATIVE_POLARITY)
+#define	ANY	(_SIDD_CMP_EQUAL_ANY)
 
-/* Warning: This skips whitespace	*/
-static char
-peek(void)
-{
-int	c;
+KERN_SSE42(ws,		"\t\r  ",				NEG)
+KERN_SSE42(str,		"\"\\",					ANY)
+KERN_SSE42(simple,	"09AZaz",				NEG)
+KERN_SSE42(quote1,	" &(~\x80\xff",				NEG)
+KERN_SSE42(quote3,	" &([]~\x80\xff",			NEG)
+KERN_SSE42(digit,	"09",					NEG)
 
-  if ((c=next())!=EOF)
-    ungetc(c, stdin);
-  xD("(%d %c)", c, cc(c));
-  return c;
+static const struct kern kern_sse42 = { "sse42", ws_sse42, str_sse42, simple_sse42, quote1_sse42, quote3_sse42, digit_sse42 };
+
+/* AVX2 and AVX-512: compare 32 or 64 bytes at once.
+ * OK(x) gives the mask of bytes which belong to the class.
+ */
+#define	KERN_VEC(NAME, ISA, TARGET, W, MASK, OK)		\
+static size_t __attribute__((target(TARGET)))			\
+NAME##_##ISA(const unsigned char *p, size_t n)			\
+{								\
+  size_t		i;					\
+  MASK			m;					\
+								\
+  for (i=0; i+W<=n; i+=W)					\
+    if ((m = ~OK(p+i)))						\
+      return i + __builtin_ctzll(m);				\
+  return i + NAME##_scalar(p+i, n-i);				\
 }
 
-/* Warning: This skips whitespace	*/
-static int
-have(int want)
+static inline __m256i __attribute__((target("avx2")))
+avx2_range(__m256i x, unsigned char lo, unsigned char hi)
 {
-  int	c;
-
-  if (want==EOF)
-    return peek()==EOF;
+  __m256i	d = _mm256_sub_epi8(x, _mm256_set1_epi8(lo));
 
-  if ((c=next())!=EOF)
-    {
-      if (c == want)
-        return 1;
-      ungetc(c, stdin);
-    }
-  return 0;
+  return _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(hi-lo)), d);
 }
 
-/* Warning: This skips whitespace on the first character	*/
-static void
-need(const char *c)
+static inline __m256i __attribute__((target("avx2")))
+avx2_eq(__m256i x, unsigned char c)
 {
-  int	got;
+  return _mm256_cmpeq_epi8(x, _mm256_set1_epi8(c));
+}
 
-  xD("(%s)", c);
-  if ((got=next()) != (unsigned char)*c)
-    OOPS("expected '%s' but got '%c'", c, got);
-  while (*++c)
-    if ((got=get()) != *c)
-      OOPS("missing '%s', got '%c'", c, got);
+#define	AVX2(P)		__m256i x = _mm256_loadu_si256((const __m256i *)(P))
+#define	AVX2_OK(EXPR)	(unsigned)_mm256_movemask_epi8(EXPR)
+static inline unsigned __attribute__((target("avx2"))) ws_ok_avx2(const unsigned char *p)	{ AVX2(p); return AVX2_OK(avx2_range(x, '\t', '\r') | avx2_eq(x, ' ')); }
+static inline unsigned __attribute__((target("avx2"))) str_ok_avx2(const unsigned char *p)	{ AVX2(p); return ~AVX2_OK(avx2_eq(x, '"') | avx2_eq(x, '\\')); }
+static inline unsigned __attribute__((target("avx2"))) simple_ok_avx2(const unsigned char *p)	{ AVX2(p); return AVX2_OK(avx2_range(x, '0', '9') | avx2_range(x, 'A', 'Z') | avx2_range(x, 'a', 'z')); }
+static inline unsigned __attribute__((target("avx2"))) quote1_ok_avx2(const unsigned char *p)	{ AVX2(p); return AVX2_OK(avx2_range(x, ' ', 255)) & ~AVX2_OK(avx2_eq(x, '\'') | avx2_eq(x, 127)); }
+static inline unsigned __attribute__((target("avx2"))) quote3_ok_avx2(const unsigned char *p)	{ AVX2(p); return AVX2_OK(avx2_range(x, ' ', 255)) & ~AVX2_OK(avx2_eq(x, '\'') | avx2_eq(x, '\\') | avx2_eq(x, 127)); }
+static inline unsigned __attribute__((target("avx2"))) digit_ok_avx2(const unsigned char *p)	{ AVX2(p); return AVX2_OK(avx2_range(x, '0', '9')); }
+
+KERN_VEC(ws,		avx2, "avx2", 32, unsigned, ws_ok_avx2)
+KERN_VEC(str,		avx2, "avx2", 32, unsigned, str_ok_avx2)
+KERN_VEC(simple,	avx2, "avx2", 32, unsigned, simple_ok_avx2)
+KERN_VEC(quote1,	avx2, "avx2", 32, unsigned, quote1_ok_avx2)
+KERN_VEC(quote3,	avx2, "avx2", 32, unsigned, quote3_ok_avx2)
+KERN_VEC(digit,		avx2, "avx2", 32, unsigned, digit_ok_avx2)
+
+static const struct kern kern_avx2 = { "avx2", ws_avx2, str_avx2, simple_avx2, quote1_avx2, quote3_avx2, digit_avx2 };
+
+#define	AVX512(P)	__m512i x = _mm512_loadu_si512((const void *)(P))
+#define	A512_RANGE(LO,HI)	_mm512_cmple_epu8_mask(_mm512_sub_epi8(x, _mm512_set1_epi8(LO)), _mm512_set1_epi8((HI)-(LO)))
+#define	A512_EQ(C)	_mm512_cmpeq_epi8_mask(x, _mm512_set1_epi8(C))
+static inline __mmask64 __attribute__((target("avx512bw"))) ws_ok_avx512(const unsigned char *p)	{ AVX512(p); return A512_RANGE('\t', '\r') | A512_EQ(' '); }
+static inline __mmask64 __attribute__((target("avx512bw"))) str_ok_avx512(const unsigned char *p)	{ AVX512(p); return ~(A512_EQ('"') | A512_EQ('\\')); }
+static inline __mmask64 __attribute__((target("avx512bw"))) simple_ok_avx512(const unsigned char *p)	{ AVX512(p); return A512_RANGE('0', '9') | A512_RANGE('A', 'Z') | A512_RANGE('a', 'z'); }
+static inline __mmask64 __attribute__((target("avx512bw"))) quote1_ok_avx512(const unsigned char *p)	{ AVX512(p); return A512_RANGE(' ', 255) & ~(A512_EQ('\'') | A512_EQ(127)); }
+static inline __mmask64 __attribute__((target("avx512bw"))) quote3_ok_avx512(const unsigned char *p)	{ AVX512(p); return A512_RANGE(' ', 255) & ~(A512_EQ('\'') | A512_EQ('\\') | A512_EQ(127)); }
+static inline __mmask64 __attribute__((target("avx512bw"))) digit_ok_avx512(const unsigned char *p)	{ AVX512(p); return A512_RANGE('0', '9'); }
+
+KERN_VEC(ws,		avx512, "avx512bw", 64, unsigned long long, ws_ok_avx512)
+KERN_VEC(str,		avx512, "avx512bw", 64, unsigned long long, str_ok_avx512)
+KERN_VEC(simple,	avx512, "avx512bw", 64, unsigned long long, simple_ok_avx512)
+KERN_VEC(quote1,	avx512, "avx512bw", 64, unsigned long long, quote1_ok_avx512)
+KERN_VEC(quote3,	avx512, "avx512bw", 64, unsigned long long, quote3_ok_avx512)
+KERN_VEC(digit,		avx512, "avx512bw", 64, unsigned long long, digit_ok_avx512)
+
+static const struct kern kern_avx512 = { "avx512", ws_avx512, str_avx512, simple_avx512, quote1_avx512, quote3_avx512, digit_avx512 };
+#endif
+
+static const struct kern	*kern_variants[] =
+  {
+#ifdef KERN_X86
+    &kern_avx512,
+    &kern_avx2,
+    &kern_sse42,
+#endif
+    &kern_scalar,
+    0
+  };
+
+static int
+kern_ok(const struct kern *k)
+{
+#ifdef KERN_X86
+  __builtin_cpu_init();
+  if (k==&kern_avx512)	return __builtin_cpu_supports("avx512bw");
+  if (k==&kern_avx2)	return __builtin_cpu_supports("avx2");
+  if (k==&kern_sse42)	return __builtin_cpu_supports("sse4.2");
+#endif
+  return 1;
 }
 
-/* Fetch a real character.
- * Bail out on EOF
+/* Select the kernels, returns 0 if the variant is unknown or unsupported
  */
 static int
-ch(void)
+kern_select(const char *isa)
 {
-  int	c;
+  const struct kern	* const *v;
 
-  if ((c = get())==EOF)
-    OOPS("unexpected EOF");
-  return c;
+  kern_table();
+  for (v=kern_variants; *v; v++)
+    if (isa ? !strcmp(isa, (*v)->name) : kern_ok(*v))
+      {
+        K	= **v;
+        return kern_ok(*v);
+      }
+  return 0;
 }
 
-/* Fetch hexadecimal value
+
+/**********************************************************************
+ * INPUT
+ *********************************************************************/
+
+/* Input is read in blocks.
+ * line and column are only calculated when needed (on errors),
+ * so the hot path just advances IN.pos.
  */
-static unsigned
-hexget(int bits, unsigned val)
+static struct
+  {
+    int			fd;
+    unsigned char	*buf;
+    size_t		pos, fill, size;
+    unsigned long long	off;		/* input offset of buf[0]	*/
+    unsigned long long	lstart;		/* offset of the line start before buf[0]	*/
+    int			line;		/* lines before buf[0]	*/
+    int			timeout;	/* seconds to wait for input, 0 is forever	*/
+  } IN = { 0, NULL, 0, 0, BUFSIZ*8 };
+
+static void
+in_lines(size_t len)
 {
-  unsigned	c;
+  const unsigned char	*p, *end;
 
-  c	= ch();
-  if (c>='0' && c<='9')
-    c	-= '0';
-  else if (c>='a' && c<='f')
-    c -= 'a'-10;
-  else if (c>='A' && c<='F')
-    c -= 'A'-10;
-  else
-    OOPSc(c, "hex digit expected");
-  return val | (c<<bits);
+  /* memchr() must not see the NULL before the first read	*/
+  if (!len || !IN.buf)
+    return;
+  for (p=IN.buf, end=p+len; (p=memchr(p, '\n', end-p))!=0; )
+    {
+      IN.line++;
+      IN.lstart	= IN.off + ++p - IN.buf;
+    }
 }
 
-/* Fetch unicode character.
- *
- * For now we do not decompose the UTF-8 input.
- * This might change in future.
+/* Set line and column from the current input position
  */
-static int
-uniget(char end)
+static void
+in_pos(void)
 {
-  int	c;
+  int			l = IN.line;
+  unsigned long long	s = IN.lstart;
+
+  in_lines(IN.pos);
+  line		= IN.line;
+  column	= IN.off + IN.pos - IN.lstart;
+  IN.line	= l;
+  IN.lstart	= s;
+}
+
+static size_t rd_next(unsigned char **buf);
+
+/* Fail if no input arrives in time
+ */
+static void
+in_wait(void)
+{
+  struct pollfd	p = { IN.fd, POLLIN };
+  int		n;
+
+  while ((n = poll(&p, 1, IN.timeout*1000))<0)
+    if (errno!=EINTR)
+      OOPS("poll failed");
+  if (!n)
+    OOPS("no input for %d seconds", IN.timeout);
+}
+
+/* Fetch the next raw input block, returns 0 on EOF
+ */
+static size_t
+in_raw(unsigned char **buf)
+{
+  static unsigned char	*mem;
+  ssize_t		got;
+
+  if (pipelined)
+    return rd_next(buf);
+  if (!mem)
+    mem	= alloc0(IN.size);
+  if (IN.timeout)
+    in_wait();
+  while ((got = read(IN.fd, mem, IN.size))<0)
+    if (errno!=EINTR)
+      OOPS("read error");
+  *buf	= mem;
+  return got;
+}
+
+/* Compressed input is detected by magic bytes
+ * and decompressed in-process into our own block.
+ * Concatenated streams are decompressed like zcat does.
+ */
+static struct
+  {
+    unsigned char	*raw, *out, *rest, head[4];
+    size_t		restlen;	/* of the block in_sniff() held back	*/
+    int			eof, end;
+#ifdef HAVE_ZLIB
+    int			gz;		/* z is initialized	*/
+    z_stream		z;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DStream	*zs;
+    ZSTD_inBuffer	zin;
+#endif
+  } DEC;
+
+/* Like in_raw(), but first returns what in_sniff() held back
+ */
+static size_t
+in_rest(unsigned char **buf)
+{
+  size_t	len = DEC.restlen;
+
+  if (!len)
+    return in_raw(buf);
+  *buf		= DEC.rest;
+  DEC.restlen	= 0;
+  return len;
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+/* Fetch more compressed input, returns 0 on EOF
+ */
+static size_t
+dec_raw(void)
+{
+  size_t	len;
+
+  if (DEC.eof)
+    return 0;
+  if (!(len = in_rest(&DEC.raw)))
+    {
+      DEC.eof	= 1;
+      if (!DEC.end)
+        OOPS("unexpected end of compressed input");
+    }
+  return len;
+}
+#endif
+
+#ifdef HAVE_ZLIB
+/* zlib allocates through us, so its state counts for --max-heap	*/
+static voidpf dec_zalloc(voidpf opaque, uInt items, uInt size) { return alloc0((size_t)items * size); }
+static void dec_zfree(voidpf opaque, voidpf ptr) { mem_free(ptr); }
+
+static size_t
+dec_gzip(unsigned char **buf)
+{
+  int	ret;
+
+  DEC.z.next_out	= DEC.out;
+  DEC.z.avail_out	= IN.size;
+  while (DEC.z.avail_out == IN.size)
+    {
+      if (!DEC.z.avail_in)
+        {
+          if (!(DEC.z.avail_in = dec_raw()))
+            break;
+          DEC.z.next_in	= DEC.raw;
+        }
+      DEC.end	= 0;
+      ret	= inflate(&DEC.z, Z_NO_FLUSH);
+      if (ret == Z_STREAM_END)
+        {
+          DEC.end	= 1;
+          inflateReset(&DEC.z);
+        }
+      else if (ret != Z_OK)
+        OOPS("gzip error %d: %s", ret, DEC.z.msg ? DEC.z.msg : "corrupt input");
+    }
+  *buf	= DEC.out;
+  return IN.size - DEC.z.avail_out;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static size_t
+dec_zstd(unsigned char **buf)
+{
+  ZSTD_outBuffer	out = { DEC.out, IN.size, 0 };
+  size_t		ret;
+
+  while (!out.pos)
+    {
+      if (DEC.zin.pos >= DEC.zin.size)
+        {
+          if (!(DEC.zin.size = dec_raw()))
+            break;
+          DEC.zin.src	= DEC.raw;
+          DEC.zin.pos	= 0;
+        }
+      ret	= ZSTD_decompressStream(DEC.zs, &out, &DEC.zin);
+      if (ZSTD_isError(ret))
+        OOPS("zstd error: %s", ZSTD_getErrorName(ret));
+      DEC.end	= !ret;
+    }
+  *buf	= DEC.out;
+  return out.pos;
+}
+#endif
+
+static size_t in_sniff(unsigned char **buf);
+static size_t (*in_dec)(unsigned char **) = in_sniff;
+
+/* Look at the first 4 bytes to see if the input is compressed.
+ * A slow pipe may deliver them in pieces, so they are collected in DEC.head
+ * and the rest of the block which completed them is returned next.
+ */
+static size_t
+in_sniff(unsigned char **buf)
+{
+  unsigned char	*p;
+  size_t	len, n;
+
+  len	= in_raw(&DEC.raw);
+  p	= DEC.raw;
+  if (len && len<4)
+    {
+      n	= 0;
+      do
+        {
+          if (len > 4-n)
+            {
+              DEC.rest		= DEC.raw + 4-n;
+              DEC.restlen	= len - (4-n);
+              len		= 4-n;
+            }
+          memcpy(DEC.head+n, DEC.raw, len);
+          n	+= len;
+        } while (n<4 && (len = in_raw(&DEC.raw)));
+      p		= DEC.head;
+      len	= n;
+    }
+  in_dec	= DEC.restlen ? in_rest : in_raw;
+  *buf		= p;
+  if (len>=2 && p[0]==0x1f && p[1]==0x8b)
+    {
+#ifdef HAVE_ZLIB
+      DEC.z.zalloc	= dec_zalloc;
+      DEC.z.zfree	= dec_zfree;
+      if ((DEC.gz ? inflateReset(&DEC.z) : inflateInit2(&DEC.z, 15+32)) != Z_OK)
+        OOPS("cannot initialize zlib");
+      DEC.gz		= 1;
+      DEC.z.next_in	= p;
+      DEC.z.avail_in	= len;
+      in_dec		= dec_gzip;
+#else
+      OOPS("gzip input, but compiled without zlib");
+#endif
+    }
+  else if (len>=4 && p[0]==0x28 && p[1]==0xb5 && p[2]==0x2f && p[3]==0xfd)
+    {
+#ifdef HAVE_ZSTD
+      if (!DEC.zs && !(DEC.zs = ZSTD_createDStream()))
+        OOPS("cannot initialize zstd");
+      ZSTD_initDStream(DEC.zs);
+      DEC.zin.src	= p;
+      DEC.zin.size	= len;
+      DEC.zin.pos	= 0;
+      in_dec		= dec_zstd;
+#else
+      OOPS("zstd input, but compiled without zstd");
+#endif
+    }
+  else
+    return len;
+
+  if (!DEC.out)
+    DEC.out	= alloc0(IN.size);
+  return in_dec(buf);
+}
+
+static int
+in_fill(void)
+{
+  in_lines(IN.fill);
+  IN.off	+= IN.fill;
+  IN.pos	= 0;
+  IN.fill	= in_dec(&IN.buf);
+  PROBE2(input__refill, IN.off, IN.fill);
+  return IN.fill>0;
+}
+
+static int
+get(void)
+{
+  if (IN.pos >= IN.fill && !in_fill())
+    return EOF;
+  xD("(%d %c)", IN.buf[IN.pos], cc(IN.buf[IN.pos]));
+  return IN.buf[IN.pos++];
+}
+
+/* Only valid directly after get() returned c
+ */
+static void
+unget(int c)
+{
+  if (c!=EOF)
+    IN.pos--;
+}
+
+/* Return the run of string bytes which need no unescaping,
+ * that is up to the next '"' or '\\' within the current block.
+ * The run is consumed.
+ */
+static size_t
+in_run(const unsigned char **run)
+{
+  size_t	len;
+
+  if (IN.pos >= IN.fill && !in_fill())
+    return 0;
+  *run	= IN.buf+IN.pos;
+  len	= K.str(*run, IN.fill-IN.pos);
+  IN.pos	+= len;
+  return len;
+}
+
+static int
+next(void)
+{
+  do
+    IN.pos	+= K.ws(IN.buf+IN.pos, IN.fill-IN.pos);
+  while (IN.pos >= IN.fill && in_fill());
+  return get();
+}
+
+/* Warning: This skips whitespace	*/
+static char
+peek(void)
+{
+int	c;
+
+  if ((c=next())!=EOF)
+    unget(c);
+  xD("(%d %c)", c, cc(c));
+  return c;
+}
+
+/* Warning: This skips whitespace	*/
+static int
+have(int want)
+{
+  int	c;
+
+  if (want==EOF)
+    return peek()==EOF;
+
+  if ((c=next())!=EOF)
+    {
+      if (c == want)
+        return 1;
+      unget(c);
+    }
+  return 0;
+}
+
+/* Warning: This skips whitespace on the first character	*/
+static void
+need(const char *c)
+{
+  int	got;
+
+  xD("(%s)", c);
+  if ((got=next()) != (unsigned char)*c)
+    OOPS("expected '%s' but got '%c'", c, got);
+  while (*++c)
+    if ((got=get()) != *c)
+      OOPS("missing '%s', got '%c'", c, got);
+}
+
+/* Fetch a real character.
+ * Bail out on EOF
+ */
+static int
+ch(void)
+{
+  int	c;
+
+  if ((c = get())==EOF)
+    OOPS("unexpected EOF");
+  return c;
+}
+
+/* Fetch a character if it is one of chars, else leave it
+ */
+static int
+in_if(const char *chars)
+{
+  int	c;
+
+  c	= ch();
+  if (c && strchr(chars, c))
+    return c;
+  unget(c);
+  return EOF;
+}
+
+/* Like in_if() for one or two characters
+ */
+static int
+in_is(int a, int b)
+{
+  int	c;
+
+  c	= ch();
+  if (c==a || c==b)
+    return c;
+  unget(c);
+  return EOF;
+}
+
+/* Fetch hexadecimal value
+ */
+static unsigned
+hexget(int bits, unsigned val)
+{
+  unsigned	c;
+
+  c	= ch();
+  if (c>='0' && c<='9')
+    c	-= '0';
+  else if (c>='a' && c<='f')
+    c -= 'a'-10;
+  else if (c>='A' && c<='F')
+    c -= 'A'-10;
+  else
+    OOPSc(c, "hex digit expected");
+  return val | (c<<bits);
+}
+
+/* Fetch unicode character.
+ *
+ * For now we do not decompose the UTF-8 input.
+ * This might change in future.
+ */
+static int
+uniget(char end)
+{
+  int	c;
 
   if ((c=ch()) < 0)
     OOPS("disallowed control character %d in JSON string", c);
@@ -493,583 +1424,3289 @@ uniget(char end)
 
 
 /**********************************************************************
- * Shell variable name (base)
+ * Pipelined I/O
  *********************************************************************/
 
-enum base_type
+/* With --pipeline a reader thread reads ahead into a ring of input blocks
+ * and a writer thread writes the flushed output buffers.
+ * So the parser does not wait for slow pipes on the hot path.
+ * Memory stays bounded, as there are only PIPE_BLOCKS buffers each.
+ */
+#define	PIPE_BLOCKS	8
+
+struct pipe_job
   {
-    B_UNSPEC	= 0,
-    B_PREFIX,
-    B_ARR,
-    B_INDEX,
-    B_OBJ,
-    B_KEY,
-    B_VAL,
+    int		fd;
+    const char	*name;
+    char	*buf;
+    size_t	len;
   };
 
-typedef struct base *BASE;
-struct base
+static struct
   {
-    /* CAVEAT!  When adding new properties here
-     * be sure to initialize them in base_new()!
-     */
-    BASE		next, top;	/* initialized	*/
-    enum base_type	type;		/* initialized	*/
-    int			done;		/* initialized	*/
-    unsigned		esc, cp;	/* initialized	*/
-    int			value;		/* initialized	*/
-    int			pos;		/* initialized	*/
-    int			buflen;		/* no initialization, taken from freelist	*/
-    char		*buf;		/* no initialization, taken from freelist	*/
-  };
+    pthread_t		rd, wr;
+    pthread_mutex_t	mx;
+    pthread_cond_t	cv;
+    /* reader: filled by rd_thread(), consumed by rd_next()	*/
+    unsigned char	*in[PIPE_BLOCKS];
+    ssize_t		inlen[PIPE_BLOCKS];
+    unsigned		head, tail;
+    int			rderr;
+    /* writer: queued by wr_queue(), written by wr_thread()	*/
+    struct pipe_job	job[PIPE_BLOCKS];
+    unsigned		jhead, jtail;
+    char		*free[PIPE_BLOCKS];
+    int			nfree, nbuf, busy, wrerr;
+  } PIPE = { 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
 
-static BASE	base_freelist;
+static void
+pipe_lock(void)
+{
+  pthread_mutex_lock(&PIPE.mx);
+}
 
-/* We just give back to the pool.
- * No cleanups, as we can reuse the buffers later.
+static void
+pipe_unlock(void)
+{
+  pthread_cond_broadcast(&PIPE.cv);
+  pthread_mutex_unlock(&PIPE.mx);
+}
+
+static void
+pipe_wait(void)
+{
+  pthread_cond_wait(&PIPE.cv, &PIPE.mx);
+}
+
+static void *
+rd_thread(void *arg)
+{
+  ssize_t	got;
+  unsigned	i;
+
+  do
+    {
+      pipe_lock();
+      while (PIPE.head - PIPE.tail >= PIPE_BLOCKS)
+        pipe_wait();
+      i	= PIPE.head % PIPE_BLOCKS;
+      pthread_mutex_unlock(&PIPE.mx);
+
+      while ((got = read(IN.fd, PIPE.in[i], IN.size))<0 && errno==EINTR);
+
+      pipe_lock();
+      PIPE.inlen[i]	= got;
+      if (got<0)
+        PIPE.rderr	= errno;
+      PIPE.head++;
+      pipe_unlock();
+    } while (got>0);
+  return 0;
+}
+
+/* Give back the block we parsed and get the next one.
+ * The block stays valid until the next call.
  */
-static BASE
-base_free(BASE b)
+static size_t
+rd_next(unsigned char **buf)
+{
+  ssize_t	got;
+
+  pipe_lock();
+  if (*buf && PIPE.inlen[PIPE.tail % PIPE_BLOCKS]>0)	/* EOF sticks	*/
+    PIPE.tail++;
+  while (PIPE.head == PIPE.tail)
+    pipe_wait();
+  got	= PIPE.inlen[PIPE.tail % PIPE_BLOCKS];
+  pipe_unlock();
+
+  if (got<0)
+    {
+      errno	= PIPE.rderr;
+      OOPS("read error");
+    }
+  *buf	= PIPE.in[PIPE.tail % PIPE_BLOCKS];
+  return got;
+}
+
+static void *
+wr_thread(void *arg)
+{
+  struct pipe_job	j;
+  size_t		pos;
+
+  pipe_lock();
+  for (;;)
+    {
+      while (PIPE.jhead == PIPE.jtail)
+        pipe_wait();
+      j	= PIPE.job[PIPE.jtail % PIPE_BLOCKS];
+      PIPE.busy	= 1;
+      pthread_mutex_unlock(&PIPE.mx);
+
+      for (pos=0; pos<j.len && !PIPE.wrerr; )
+        {
+          ssize_t	got;
+
+          got	= write(j.fd, j.buf+pos, j.len-pos);
+          if (got>0)
+            pos	+= got;
+          else if (!got || errno!=EINTR)
+            PIPE.wrerr	= errno ? errno : EIO;
+        }
+
+      pipe_lock();
+      PIPE.free[PIPE.nfree++]	= j.buf;
+      PIPE.jtail++;
+      PIPE.busy	= 0;
+      pthread_cond_broadcast(&PIPE.cv);
+    }
+  return 0;
+}
+
+static void
+wr_check(const char *name)
+{
+  if (PIPE.wrerr)
+    {
+      errno	= PIPE.wrerr;
+      OOPS("write error on %s", name);
+    }
+}
+
+/* Hand a sink buffer to the writer thread and return a free one.
+ */
+static char *
+wr_queue(int fd, const char *name, char *buf, size_t len)
+{
+  struct pipe_job	*j;
+
+  wr_check(name);
+  pipe_lock();
+  while (PIPE.jhead - PIPE.jtail >= PIPE_BLOCKS || (!PIPE.nfree && PIPE.nbuf >= PIPE_BLOCKS))
+    pipe_wait();
+  j		= &PIPE.job[PIPE.jhead++ % PIPE_BLOCKS];
+  j->fd		= fd;
+  j->name	= name;
+  j->buf	= buf;
+  j->len	= len;
+  if (PIPE.nfree)
+    buf	= PIPE.free[--PIPE.nfree];
+  else
+    {
+      PIPE.nbuf++;
+      buf	= 0;
+    }
+  pipe_unlock();
+  return buf ? buf : alloc0(BUFSIZ*8);
+}
+
+/* Wait until everything queued is written
+ */
+static void
+wr_sync(void)
+{
+  if (!pipelined)
+    return;
+  pipe_lock();
+  while (PIPE.jhead != PIPE.jtail || PIPE.busy)
+    pipe_wait();
+  pthread_mutex_unlock(&PIPE.mx);
+  wr_check("output");
+}
+
+static void
+pipe_start(void)
+{
+  int	i;
+
+  for (i=0; i<PIPE_BLOCKS; i++)
+    PIPE.in[i]	= alloc0(IN.size);
+  pipelined	= 1;
+  if (pthread_create(&PIPE.rd, NULL, rd_thread, NULL) || pthread_create(&PIPE.wr, NULL, wr_thread, NULL))
+    OOPS("cannot create thread");
+}
+
+/**********************************************************************
+ * Shell variable name (base)
+ *********************************************************************/
+
+enum base_type
+  {
+    B_UNSPEC	= 0,
+    B_PREFIX,
+    B_ARR,
+    B_INDEX,
+    B_OBJ,
+    B_KEY,
+    B_VAL,
+  };
+
+typedef struct base *BASE;
+struct base
+  {
+    /* CAVEAT!  When adding new properties here
+     * be sure to initialize them in base_new()!
+     */
+    BASE		next, top;	/* initialized	*/
+    enum base_type	type;		/* initialized	*/
+    int			done;		/* initialized	*/
+    unsigned		esc, cp;	/* initialized	*/
+    int			value;		/* initialized	*/
+    int			pos;		/* initialized	*/
+    int			buflen;		/* no initialization, taken from freelist	*/
+    char		*buf;		/* no initialization, taken from freelist	*/
+  };
+
+static BASE	base_freelist;
+
+/* We just give back to the pool.
+ * No cleanups, as we can reuse the buffers later.
+ */
+static BASE
+base_free(BASE b)
+{
+  BASE	tmp	= b->next;
+
+  b->next	= base_freelist;
+  b->type	= B_UNSPEC;
+
+  base_freelist	= b;
+  return tmp;
+}
+
+/* Like base_free(), but after an error, as the buffer
+ * may have grown up to the limit and is not kept.
+ */
+static BASE
+base_drop(BASE b)
+{
+  mem_free(b->buf);
+  b->buf	= 0;
+  b->buflen	= 0;
+  return base_free(b);
+}
+
+/* Append some unicode character to our base.
+ */
+static void
+base_grow(BASE b)
+{
+  if (b->pos >= b->buflen)
+    {
+      b->buf	=  re_alloc(b->buf, b->buflen+BUFSIZ);
+      b->buflen	+= BUFSIZ;
+    }
+}
+
+static void
+base_put(BASE b, int c)
+{
+  base_grow(b);
+  b->buf[b->pos++]	= c;
+  if (b->type != B_VAL)
+    outc(c);
+}
+
+static void
+base_putn(BASE b, const unsigned char *s, size_t n)
+{
+  size_t	len = (b->pos+n+BUFSIZ) / BUFSIZ * BUFSIZ;
+
+  /* a fresh base has no buffer yet, which memcpy() must not see	*/
+  if (!n)
+    return;
+  if (b->pos+n > b->buflen)
+    {
+      b->buf	=  re_alloc(b->buf, len);
+      b->buflen	= len;
+    }
+  memcpy(b->buf+b->pos, s, n);
+  b->pos	+= n;
+  if (b->type != B_VAL)
+    outn((const char *)s, n);
+}
+
+static void
+base_esc_end(BASE b)
+{
+  D("(%d)", b->esc);
+  if (b->esc)
+    base_put(b, '_');
+  b->esc	= 0;
+  b->cp		= 0;
+}
+
+/* actually, this is a hack	*/
+static BASE
+base_child(BASE p, BASE b)
+{
+  FATAL(b->type==B_UNSPEC);
+  if (p)
+    {
+      FATAL(b==p);
+      FATAL(p->type==B_UNSPEC);
+      FATAL(p->next && p->next!=b);
+      p->next	= b;
+      b->top	= p->top;
+      if (b->done)	/* cannot happen, but perhaps in future	*/
+        p->done	= 1;
+
+      /* finish building variable name when value node follows	*/
+      if (b->type == B_VAL)
+        base_esc_end(p);
+
+      /* copy codepage and esc mode from parent	*/
+      b->esc	= p->esc;
+      b->cp	= p->cp;
+    }
+  FATAL(b->next);
+  return b;
+}
+
+static BASE
+base_new(BASE p, enum base_type type)
+{
+  BASE	b;
+
+  FATAL(p && p->type==B_UNSPEC);
+
+  if (!base_freelist)
+    base_freelist	= alloc0(sizeof *base_freelist);
+
+  b		= base_freelist;
+  base_freelist	= b->next;
+
+  FATAL(b->type!=B_UNSPEC);
+
+  /* CAVEAT!  When adding new properties to BASE
+   * be sure to initialize them here!
+   */
+  b->next	= 0;
+  b->top	= b;
+  b->type	= type;
+  b->done	= 0;
+  b->esc	= 0;
+  b->cp		= 0;
+  b->value	= 0;
+  b->pos	= 0;
+  /* buflen and buf kept	*/
+
+  return base_child(p, b);
+}
+
+/* Cut the remaining base->next pointers.
+ * This is because we are lazy.
+ * We create base(parent), but we do not free it.
+ *
+ * Due to recursion, we know the sub-thing is no more needed,
+ * so we can give it back to the pool.
+ */
+static void
+base_cut(BASE p)
+{
+  BASE	b;
+
+  if (p)
+    {
+      for (b=p->next; b; b=base_free(b))
+        if (b->done)
+          p->done	= 1;
+      p->next	= 0;
+    }
+}
+
+static int
+base_done(BASE b)
+{
+  base_cut(b);
+  return b->done;
+}
+
+/* Length of the name from b up to (excluding) end
+ */
+static unsigned long
+base_len(BASE b, BASE end)
+{
+  unsigned long	len;
+
+  for (len=0; b && b!=end; b=b->next)
+    len	+= b->pos;
+  return len;
+}
+
+/* Print out (repeat) the SHell variable name up to here
+ */
+static void
+base_print(BASE b)
+{
+  D("(%p %d)", b, b->type);
+  nl();
+  if (bulk.pending)
+    bulk_begin();
+  for (; b; b=b->next)
+    {
+      outn(b->buf, b->pos);
+      b->done	= 0;
+    }
+}
+
+/* Setup for a new value to print out
+ */
+static BASE
+base(BASE p, enum base_type type)
+{
+  D("(%p t=%d)", p, type);
+  base_cut(p);
+
+  D(" x1");
+  if (p && p->done)
+    base_print(p->top);
+
+  D(" x2");
+  return base_new(p, type);
+}
+
+static void route_default(BASE b);
+
+static void
+base_fin(BASE b)
+{
+  base_esc_end(b);
+  if (OUT == &discard)
+    route_default(b);
+  if (!b->done)
+    {
+      values++;
+      /* the top-level value is [0], as $NAME is ${NAME[0]} in bash	*/
+      if (bulk.assoc && base_len(b->top, NULL)==1)
+        outc('0');
+      OUT->mark	= OUT->fill;
+      out_SEP();
+    }
+  b->done	= 1;
+}
+
+static void
+base_out(BASE b, const char *s, ...)
+{
+  va_list	list;
+
+  va_start(list, s);
+  vout(s, list);
+  va_end(list);
+}
+
+/* Send character, perhaps switching in esc mode:
+ * 0: plain characters (0-9 A-Z a-z)
+ * 1: indexes (1-999999999999999999999)
+ * 2: object separator _0_
+ * 3: all other escapes
+ */
+static void
+base_esc(BASE b, int c, int esc)
+{
+  if (b->esc != esc && (b->esc & esc)==0)
+    {
+      base_esc_end(b);
+      if (esc)
+        base_put(b, '_');
+    }
+  b->esc	= esc;
+  base_put(b, c);
+}
+
+/* literal output (variable name)
+ */
+static void
+base_set(BASE b, struct _buf *buf)
+{
+  int i;
+
+  for (i=0; i<buf->len; i++)
+    base_esc(b, buf->buf[i], 0);
+}
+
+static BASE
+base_index(BASE p, unsigned long long index)
+{
+  BASE	b = base(p, B_INDEX);
+  char	buf[200], *ptr;
+
+  base_esc_end(b);
+  snprintf(buf, sizeof buf, "%llu", index);
+  for (ptr=buf; *ptr; )
+    base_esc(b, *ptr++, 1);
+  return b;
+}
+
+/* --max-name for names which did not pass get_key()
+ */
+static void
+name_limit(BASE b)
+{
+  if (limit.name && base_len(b->top, NULL) > limit.name)
+    OOPS("name longer than %lu characters", limit.name);
+}
+
+/* Reuse the index node b for the next array index.
+ * Its subtree was cut, so it is reset to the state after the digits,
+ * which run from dig to end, and the decimal is incremented in place.
+ * Returns the new end.
+ */
+static int
+base_reindex(BASE b, int dig, int end)
+{
+  int	i;
+
+  b->pos	= end;
+  b->esc	= 1;
+  b->cp		= 0;
+  b->done	= 0;
+  for (i=end; --i>=dig && b->buf[i]=='9'; )
+    b->buf[i]	= '0';
+  if (i>=dig)
+    {
+      b->buf[i]++;
+      return end;
+    }
+  b->buf[dig]	= '1';
+  base_grow(b);
+  b->buf[b->pos++]	= '0';
+  name_limit(b);
+  return b->pos;
+}
+
+static void
+base_hex(BASE b, int hex)
+{
+  base_esc(b, "zyxwusqpomlkjihg"[hex&0xf], 3);
+}
+
+static void
+base_cp26(BASE b, unsigned cp)
+{
+  if (cp>25)
+    base_cp26(b, cp/26);
+  base_esc(b, "ABCDEFGHIJKLMNOPQRSTUVWXYZ"[cp%26], 3);
+}
+
+static void
+base_cp(BASE b, unsigned cp)
+{
+  if (b->cp==cp)
+    return;
+
+  b->cp	= cp;
+  base_cp26(b, cp);
+}
+
+static int
+simple_value(int ch)
+{
+  return (ch>='0' && ch<='9') || (ch>='A' && ch<='Z') || (ch>='a' && ch<='z');
+}
+
+static void
+base_escape(BASE b, int ch)
+{
+  switch (ch)
+    {
+    case EOF:	return;
+    case '_':
+      /* perhaps delay a bit, to see if we enter or leave ->esc	*/
+      if (b->esc)
+        base_esc(b, 'c', 3);
+      else
+        {
+          base_esc(b, ch, 0);
+          base_esc(b, ch, 0);
+        }
+      return;
+
+    case '\a':	base_esc(b, 'a', 3);	return;
+    case '\b':	base_esc(b, 'b', 3);	return;
+    case '\177':base_esc(b, 'd', 3);	return;
+    case '\033':base_esc(b, 'e', 3);	return;
+    case '\f':	base_esc(b, 'f', 3);	return;
+    case '\n':	base_esc(b, 'n', 3);	return;
+    case '\r':	base_esc(b, 'r', 3);	return;
+    case '\t':	base_esc(b, 't', 3);	return;
+    case '\v':	base_esc(b, 'v', 3);	return;
+    }
+
+  if (simple_value(ch))
+    {
+      base_esc(b, ch, 0);
+      return;
+    }
+
+  base_cp(b, ch>>8);
+  base_hex(b, ch>>4);
+  base_hex(b, ch);
+}
+
+static void raw_value(BASE b, int type, const char *s, size_t len);
+
+static void
+base_add(BASE b, int ch)
+{
+  if (raw)
+    {
+      if (ch == EOF)
+        raw_value(b, 'n', b->buf, b->pos);
+      else
+        base_put(b, ch);
+      return;
+    }
+  if (ch == EOF)
+    switch (b->value)
+      {
+      case 0: outn(b->buf, b->pos); return;
+      case 1: outc('\''); outn(b->buf, b->pos);
+      default: outc('\''); return;
+      }
+  if (b->value<2 && b->pos < 255)
+    if ((b->value==0 && simple_value(ch)) || (b->value=1, ch>=32 && ch<=255 && ch!='\'' && ch!=127))
+      {
+        base_put(b, ch);
+        return;
+      }
+  if (b->value < 3)
+    {
+      int	i;
+
+      PROBE2(quote__escalate, b->value, b->pos);
+      outn("$'", 2);
+      for (i=0; i<b->pos; i++)
+        oute((unsigned char)b->buf[i]);
+    }
+  b->value	= 3;
+  oute(ch);
+}
+
+/* Same as base_add() for each byte, but works on runs
+ */
+static void
+base_addn(BASE b, const unsigned char *p, size_t n)
+{
+  size_t	len;
+
+  if (raw)
+    {
+      base_putn(b, p, n);
+      return;
+    }
+  while (n)
+    {
+      if (b->value<2 && b->pos < 255)
+        {
+          len	= (b->value ? K.quote1 : K.simple)(p, n);
+          if (len > 255-b->pos)
+            len	= 255-b->pos;
+          base_putn(b, p, len);
+        }
+      else if (b->value==3)
+        {
+          len	= K.quote3(p, n);
+          outn((const char *)p, len);
+        }
+      else
+        len	= 0;
+      p	+= len;
+      n	-= len;
+      if (n)
+        {
+          base_add(b, *p++);
+          n--;
+        }
+    }
+}
+
+static int
+base_if(BASE b, const char *chars)
+{
+  int	c;
+
+  if ((c = in_if(chars))==EOF)
+    return 0;
+  base_fin(b);
+  base_add(b, c);
+  return 1;
+}
+
+static int
+base_digit(BASE b)
+{
+  return base_if(b, "0123456789");
+}
+
+static void
+base_digits(BASE b)
+{
+  size_t	n;
+
+  if (!base_digit(b))
+    OOPS("number expected");
+  do
+    {
+      n	= K.digit(IN.buf+IN.pos, IN.fill-IN.pos);
+      base_addn(b, IN.buf+IN.pos, n);
+      IN.pos	+= n;
+    } while (IN.pos >= IN.fill && base_digit(b));
+}
+
+
+/**********************************************************************
+ * Output routing (fan-out)
+ *********************************************************************/
+
+/* The top-level key or index selects the sink.
+ * While the key is parsed, output goes to the discard sink.
+ * Afterwards the name is printed again into the selected sink.
+ */
+struct route
+  {
+    struct route	*next;
+    struct _buf		*key;		/* NULL for index ranges	*/
+    unsigned long long	from, to;
+    struct sink		*sink;
+  };
+
+static struct route	*routes;
+static struct { char *buf; size_t len, max; int hi; } rkey;
+
+static struct sink *
+sink_open(const char *name)
+{
+  struct sink	*s, **last;
+  char		*end;
+
+  for (last= &sinks; (s = *last)!=0; last= &s->next)
+    if (!strcmp(s->name, name))
+      return s;
+
+  s		= alloc0(sizeof *s);
+  s->name	= name;
+  if (name[0]=='&' && name[1])
+    {
+      s->fd	= strtol(name+1, &end, 10);
+      if (*end || s->fd<0)
+        OOPS("invalid file descriptor: %s", name);
+    }
+  else if ((s->fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0666))<0)
+    OOPS("cannot open %s", name);
+  *last	= s;
+  return s;
+}
+
+/* SPEC is .KEY for object keys, N or N-M or N- for array indexes
+ */
+static void
+route_add(const char *spec, const char *file)
+{
+  struct route	*r, **last;
+  char		*end;
+
+  r		= alloc0(sizeof *r);
+  if (*spec=='.')
+    r->key	= buf(spec+1);
+  else
+    {
+      r->from	= strtoull(spec, &end, 10);
+      r->to	= r->from;
+      if (*end=='-' && !*++end)
+        r->to	= (unsigned long long)-1;
+      else if (end[-1]=='-')
+        r->to	= strtoull(end, &end, 10);
+      if (end==spec || *end || !r->from || r->to<r->from)
+        OOPS("invalid route: %s", spec);
+    }
+  r->sink	= sink_open(file);
+  for (last= &routes; *last; last= &(*last)->next);
+  *last	= r;
+}
+
+/* Called before a new element of container p is started.
+ * Returns true if this is a top-level element which needs routing.
+ */
+static int
+route_top(BASE p)
+{
+  if (!routes || p->top->next != p)
+    return 0;
+  OUT		= &discard;
+  rkey.len	= 0;
+  rkey.hi	= 0;
+  return 1;
+}
+
+/* Collect the key in UTF-8 like the routes are given.
+ * Input bytes are taken as is, escapes (esc set) are encoded
+ * and surrogate pairs combined.  EOF ends the key.
+ */
+static void
+route_put(int c, int esc)
+{
+  if (rkey.len+8 >= rkey.max)
+    {
+      rkey.buf	=  re_alloc(rkey.buf, rkey.max+BUFSIZ);
+      rkey.max	+= BUFSIZ;
+    }
+  if (rkey.hi && esc && c>=0xdc00 && c<0xe000)
+    c	= 0x10000 + ((rkey.hi-0xd800)<<10) + (c-0xdc00);
+  else if (rkey.hi)
+    rkey.len	+= utf8(rkey.buf+rkey.len, rkey.hi);
+  rkey.hi	= 0;
+  if (c==EOF)
+    return;
+  if (esc && c>=0xd800 && c<0xdc00)
+    rkey.hi	= c;
+  else if (esc)
+    rkey.len	+= utf8(rkey.buf+rkey.len, c);
+  else
+    rkey.buf[rkey.len++]	= c;
+}
+
+static void
+route_to(BASE b, struct sink *s)
+{
+  OUT	= s;
+  base_print(b->top);
+}
+
+/* Nothing matched, so the line goes to stdout
+ */
+static void
+route_default(BASE b)
+{
+  route_to(b, &stdsink);
+}
+
+static void
+route_key(BASE b)
+{
+  struct route	*r;
+
+  route_put(EOF, 0);
+  for (r=routes; r; r=r->next)
+    if (r->key && r->key->len==rkey.len && !memcmp(r->key->buf, rkey.buf, rkey.len))
+      return route_to(b, r->sink);
+}
+
+static void
+route_index(BASE b, unsigned long long index)
+{
+  struct route	*r;
+
+  for (r=routes; r; r=r->next)
+    if (!r->key && index>=r->from && index<=r->to)
+      return route_to(b, r->sink);
+}
+
+
+/**********************************************************************
+ * Large value offload
+ *********************************************************************/
+
+/* Strings longer than offload_max bytes are written into a file in offload_dir.
+ * The value then becomes $JSON_file_'path'.
+ * Until we know, the first bytes are held back as unicode characters,
+ * such that short strings come out exactly as without offloading.
+ */
+static unsigned long	offload_max;
+static const char	*offload_dir;
+static struct sink	spill = { NULL, NULL, -1 };
+static struct { int *buf; size_t len, max, bytes; } held;
+
+static void
+spill_put(int c)
+{
+  char	tmp[4];
+
+  if (c<256)
+    {
+      tmp[0]	= c;
+      sink_write(&spill, tmp, 1);
+    }
+  else
+    sink_write(&spill, tmp, utf8(tmp, c));
+}
+
+static void
+spill_open(void)
+{
+  static char	*path;
+  static size_t	len;
+  size_t	i;
+
+  if (!path)
+    {
+      len	= strlen(offload_dir);
+      path	= alloc0(len + sizeof "/" NAME ".XXXXXX");
+      memcpy(path, offload_dir, len);
+    }
+  strcpy(path+len, "/" NAME ".XXXXXX");
+  if ((spill.fd = mkstemp(path))<0)
+    OOPS("cannot create file in %s", offload_dir);
+  spill.name	= path;
+  for (i=0; i<held.len; i++)
+    spill_put(held.buf[i]);
+}
+
+static void
+held_put(int c)
+{
+  if (held.len >= held.max)
+    {
+      held.buf	=  re_alloc(held.buf, (held.max+BUFSIZ) * sizeof *held.buf);
+      held.max	+= BUFSIZ;
+    }
+  held.buf[held.len++]	= c;
+  /* as spill_put() writes it	*/
+  held.bytes		+= c<0x100 ? 1 : c<0x800 ? 2 : c<0x10000 ? 3 : 4;
+}
+
+/* Like the loop in get_string(), but offloads big strings.
+ * Once spilled, runs without escapes are copied from the input block.
+ */
+static void
+get_offload(BASE b)
+{
+  const unsigned char	*run;
+  const char		*s;
+  size_t		i, len;
+  int			c;
+
+  held.len	= 0;
+  held.bytes	= 0;
+  spill.fd	= -1;
+  for (;;)
+    {
+      if (spill.fd>=0 && (len = in_run(&run))>0)
+        {
+          sink_write(&spill, (const char *)run, len);
+          continue;
+        }
+      if ((c=uniget('"'))==EOF)
+        break;
+      if (spill.fd>=0)
+        spill_put(c);
+      else
+        {
+          held_put(c);
+          if (held.bytes > offload_max)
+            spill_open();
+        }
+    }
+
+  if (spill.fd<0)
+    {
+      for (i=0; i<held.len; i++)
+        base_add(b, held.buf[i]);
+      base_add(b, EOF);
+      return;
+    }
+
+  sink_flush(&spill);
+  wr_sync();
+  if (close(spill.fd))
+    OOPS("write error on %s", spill.name);
+  spill.fd	= -1;
+
+  base_out(b, "$JSON_file_");
+  for (s=spill.name; *s; s++)
+    base_add(b, (unsigned char)*s);
+  base_add(b, EOF);
+}
+
+/**********************************************************************
+ * Raw records
+ *********************************************************************/
+
+/* With --raw each value is a record for programs which are not shells:
+ *	NAME TYPE LEN\n
+ *	LEN bytes of the value\n
+ * TYPE is s (string), n (number), b (true or false), z (null), a ([]) or o ({}).
+ * The value is the decoded string, else the JSON text.
+ * As nothing is quoted, strings without escapes which end within the input block
+ * are copied from it into the output buffer in one go, skipping base_add().
+ * As such a string is shorter than the block, it never bypasses the output buffer.
+ * Others are collected in raw_val, as LEN must come first.
+ * Escapes are written as UTF-8, surrogate pairs are combined
+ * and lone surrogates are encoded like any other codepoint (WTF-8).
+ */
+static struct gbuf	raw_val;
+
+static void
+raw_value(BASE b, int type, const char *s, size_t len)
+{
+  base_out(b, "%c %zu\n", type, len);
+  outn(s, len);
+}
+
+/* Like the loop in get_string(), but without quoting
+ */
+static void
+get_raw(BASE b)
+{
+  const unsigned char	*run;
+  size_t		len;
+  char			tmp[4];
+  int			c, hi = 0;
+
+  run	= IN.buf+IN.pos;
+  len	= K.str(run, IN.fill-IN.pos);
+  if (IN.pos+len < IN.fill && run[len]=='"')
+    {
+      IN.pos	+= len+1;
+      raw_value(b, 's', (const char *)run, len);
+      return;
+    }
+  raw_val.len	= 0;
+  for (;;)
+    {
+      /* in_run() takes all but '"' and '\\', so c always comes from an escape	*/
+      if ((len = in_run(&run))>0)
+        c	= -1;
+      else if ((c=uniget('"'))==EOF)
+        break;
+      if (hi && c>=0xdc00 && c<0xe000)
+        {
+          c	= 0x10000 + ((hi-0xd800)<<10) + (c-0xdc00);
+          hi	= 0;
+        }
+      if (hi)
+        gbuf_put(&raw_val, tmp, utf8(tmp, hi));
+      hi	= 0;
+      if (c>=0xd800 && c<0xdc00)
+        hi	= c;
+      else if (c>=0)
+        gbuf_put(&raw_val, tmp, utf8(tmp, c));
+      else
+        gbuf_put(&raw_val, (const char *)run, len);
+    }
+  if (hi)
+    gbuf_put(&raw_val, tmp, utf8(tmp, hi));
+  raw_value(b, 's', raw_val.buf, raw_val.len);
+}
+
+/**********************************************************************
+ * Incremental diff
+ *********************************************************************/
+
+/* With --diff only lines which changed since the previous run are output,
+ * followed by "unset NAME" for names which vanished.
+ *
+ * The snapshot file is memory mapped and looks like:
+ *	header	magic, count of records, offset of index
+ *	records	in document order: name hash, value hash, name length, name
+ *	index	record offsets sorted by name hash
+ * The name is kept for the unset.
+ * The new snapshot is streamed to FILE.new, which replaces FILE at the end.
+ */
+struct diff_hdr
+  {
+    char		magic[8];
+    unsigned long long	count, index;
+  };
+struct diff_rec
+  {
+    unsigned long long	name, value;
+    unsigned		len, pad;
+    char		buf[];
+  };
+struct diff_idx
+  {
+    unsigned long long	name, off;
+  };
+
+static struct
+  {
+    const char		*path;
+    char		*tmp;
+    const char		*map;
+    size_t		maplen;
+    const unsigned long long	*index;
+    unsigned long long	count, next;
+    unsigned char	*seen;
+    struct sink		cap, snap;
+    struct diff_idx	*idx;
+    unsigned long long	recs, max, off;
+    int			made;		/* FILE.new exists	*/
+  } diff;
+
+static const char diff_magic[8] = NAME "\001";
+
+static unsigned long long
+hash(const char *s, size_t len)
+{
+  unsigned long long	h = 0xcbf29ce484222325ull;
+
+  while (len--)
+    h	= (h ^ (unsigned char)*s++) * 0x100000001b3ull;
+  return h;
+}
+
+static size_t
+diff_size(size_t len)
+{
+  return (sizeof(struct diff_rec) + len + 7) & ~(size_t)7;
+}
+
+static const struct diff_rec *
+diff_rec(unsigned long long off)
+{
+  return (const struct diff_rec *)(diff.map + off);
+}
+
+/* Find the old record of a name, returns its offset or 0.
+ * Names usually come in the same order as last time,
+ * so the record following the last hit is tried first.
+ */
+static unsigned long long
+diff_find(unsigned long long h, const char *name, size_t len)
+{
+  const struct diff_rec	*r;
+  unsigned long long	lo, hi, mid, off;
+
+  off	= diff.next;
+  if (off < diff.maplen && off < ((const struct diff_hdr *)diff.map)->index)
+    {
+      r	= diff_rec(off);
+      if (r->name==h && r->len==len && !memcmp(r->buf, name, len))
+        goto out;
+    }
+  for (lo=0, hi=diff.count; lo<hi; )
+    {
+      mid	= (lo+hi)/2;
+      if (diff_rec(diff.index[mid])->name < h)
+        lo	= mid+1;
+      else
+        hi	= mid;
+    }
+  for (; lo<diff.count && (r=diff_rec(off=diff.index[lo]))->name==h; lo++)
+    if (r->len==len && !memcmp(r->buf, name, len))
+      goto out;
+  return 0;
+
+out:
+  diff.seen[off/8/8]	|= 1<<(off/8%8);
+  diff.next		= off + diff_size(r->len);
+  return off;
+}
+
+/* The snapshot is not trusted:  The records must exactly fill the space
+ * up to the index, and each index entry must be the start of a record.
+ */
+static int
+diff_valid(const struct diff_hdr *h)
+{
+  unsigned char		*start;
+  unsigned long long	off, n, i;
+  int			ok = 1;
+
+  start	= alloc0(diff.maplen/64+1);
+  for (n=0, off=sizeof *h; off < h->index; n++)
+    {
+      if (h->index - off < sizeof(struct diff_rec) || h->index - off < diff_size(diff_rec(off)->len))
+        break;
+      start[off/8/8]	|= 1<<(off/8%8);
+      off	+= diff_size(diff_rec(off)->len);
+    }
+  if (off != h->index || n != h->count)
+    ok	= 0;
+  for (i=0; ok && i<h->count; i++)
+    {
+      off	= diff.index[i];
+      if (off >= h->index || off%8 || !(start[off/8/8] & (1<<(off/8%8)))
+          || (i && diff_rec(diff.index[i-1])->name > diff_rec(off)->name))
+        ok	= 0;
+    }
+  mem_free(start);
+  return ok;
+}
+
+static void
+diff_load(void)
+{
+  const struct diff_hdr	*h;
+  struct stat		st;
+  int			fd;
+
+  if ((fd = open(diff.path, O_RDONLY))<0)
+    {
+      if (errno!=ENOENT)
+        OOPS("cannot open %s", diff.path);
+      return;
+    }
+  if (fstat(fd, &st))
+    OOPS("cannot stat %s", diff.path);
+  diff.maplen	= st.st_size;
+  if (diff.maplen < sizeof *h)
+    OOPS("not a snapshot: %s", diff.path);
+  diff.map	= mmap(NULL, diff.maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (diff.map == MAP_FAILED)
+    OOPS("cannot mmap %s", diff.path);
+  close(fd);
+
+  h	= (const struct diff_hdr *)diff.map;
+  if (memcmp(h->magic, diff_magic, sizeof h->magic) || h->index<sizeof *h || h->index>diff.maplen
+      || (diff.maplen - h->index) / sizeof *diff.index != h->count)
+    OOPS("not a snapshot: %s", diff.path);
+  diff.count	= h->count;
+  diff.index	= (const unsigned long long *)(diff.map + h->index);
+  if (!diff_valid(h))
+    OOPS("not a snapshot: %s", diff.path);
+  diff.next	= sizeof *h;
+  diff.seen	= alloc0(diff.maplen/64+1);
+}
+
+static void
+diff_save(unsigned long long h, unsigned long long v, const char *name, size_t len)
+{
+  static const char	pad[8];
+  struct diff_rec	r;
+
+  if (diff.recs >= diff.max)
+    {
+      diff.idx	=  re_alloc(diff.idx, (diff.max+BUFSIZ) * sizeof *diff.idx);
+      diff.max	+= BUFSIZ;
+    }
+  diff.idx[diff.recs].name	= h;
+  diff.idx[diff.recs++].off	= diff.off;
+
+  memset(&r, 0, sizeof r);
+  r.name	= h;
+  r.value	= v;
+  r.len		= len;
+  sink_write(&diff.snap, (const char *)&r, sizeof r);
+  sink_write(&diff.snap, name, len);
+  sink_write(&diff.snap, pad, diff_size(len) - sizeof r - len);
+  diff.off	+= diff_size(len);
+}
+
+/* Called with each complete line in diff.cap
+ */
+static void
+diff_line(struct sink *s)
+{
+  unsigned long long	h, v, off;
+
+  h	= hash(s->buf, s->mark);
+  v	= hash(s->buf + s->mark, s->fill - s->mark);
+  off	= diff.map ? diff_find(h, s->buf, s->mark) : 0;
+  if (!off || diff_rec(off)->value != v)
+    {
+      sink_write(&stdsink, s->buf, s->fill);
+      stdsink.open	= 0;
+    }
+  diff_save(h, v, s->buf, s->mark);
+  s->fill	= 0;
+}
+
+static void
+diff_open(const char *path)
+{
+  struct diff_hdr	h;
+
+  diff.path	= path;
+  diff.tmp	= alloc0(strlen(path) + sizeof ".new");
+  strcat(strcpy(diff.tmp, path), ".new");
+  diff_load();
+
+  diff.snap.name	= diff.tmp;
+  if ((diff.snap.fd = open(diff.tmp, O_WRONLY|O_CREAT|O_TRUNC, 0666))<0)
+    OOPS("cannot create %s", diff.tmp);
+  diff.made	= 1;
+  memset(&h, 0, sizeof h);
+  sink_write(&diff.snap, (const char *)&h, sizeof h);
+  diff.off	= sizeof h;
+
+  diff.cap.name	= path;
+  diff.cap.fd	= -1;
+  diff.cap.grow	= 1;
+  diff.cap.eol	= diff_line;
+  OUT		= &diff.cap;
+}
+
+static int
+diff_cmp(const void *a, const void *b)
+{
+  const struct diff_idx	*x = a, *y = b;
+
+  return x->name < y->name ? -1 : x->name > y->name;
+}
+
+/* Unset vanished names and replace the snapshot
+ */
+static void
+diff_end(void)
+{
+  const struct diff_rec	*r;
+  struct diff_hdr	h;
+  unsigned long long	off, i;
+
+  OUT	= &diff.cap;
+  nl();
+
+  OUT	= &stdsink;
+  if (diff.map)
+    for (off=sizeof h; off < ((const struct diff_hdr *)diff.map)->index; off += diff_size(r->len))
+      {
+        r	= diff_rec(off);
+        if (diff.seen[off/8/8] & (1<<(off/8%8)))
+          continue;
+        outn("unset ", 6);
+        outn(r->buf, r->len);
+        outb(LF);
+      }
+  stdsink.open	= 0;
+
+  qsort(diff.idx, diff.recs, sizeof *diff.idx, diff_cmp);
+  for (i=0; i<diff.recs; i++)
+    sink_write(&diff.snap, (const char *)&diff.idx[i].off, sizeof diff.idx[i].off);
+  sink_flush(&diff.snap);
+  wr_sync();
+
+  memcpy(h.magic, diff_magic, sizeof h.magic);
+  h.count	= diff.recs;
+  h.index	= diff.off;
+  if (pwrite(diff.snap.fd, &h, sizeof h, 0) != sizeof h || close(diff.snap.fd))
+    OOPS("write error on %s", diff.tmp);
+  if (rename(diff.tmp, diff.path))
+    OOPS("cannot rename %s to %s", diff.tmp, diff.path);
+  diff.made	= 0;
+}
+
+/* On errors the snapshot stays as it was and FILE.new goes
+ */
+static void
+diff_abort(void)
+{
+  if (diff.made)
+    unlink(diff.tmp);
+  diff.made	= 0;
+}
+
+/**********************************************************************
+ * JSON helpers
+ *********************************************************************/
+
+/* if b!=NULL then assemble a string suitable for shell variable,
+ * else assemble a string suitable for shell variable content.
+ */
+static BASE
+get_string(BASE p)
+{
+  BASE			b = base(p, B_VAL);
+  const unsigned char	*run;
+  size_t		len;
+  int			c;
+
+  base_fin(b);
+  D("");
+  need("\"");
+  if (raw)
+    get_raw(b);
+  else if (offload_dir)
+    get_offload(b);
+  else
+    {
+      for (;;)
+        {
+          if ((len = in_run(&run))>0)
+            base_addn(b, run, len);
+          else if ((c=uniget('"'))!=EOF)
+            base_add(b, c);
+          else
+            break;
+        }
+      base_add(b, EOF);
+    }
+  D(" ret");
+
+  return b;
+}
+
+static BASE
+get_key(BASE p)
+{
+  int			top = route_top(p);
+  BASE			b = base(p, B_KEY);
+  const unsigned char	*run;
+  size_t		n, i;
+  int			c, esc = 0;
+  unsigned long		len = 0, pre = 0;
+
+  if (limit.name)
+    pre	= base_len(b->top, b);
+  need("\"");
+  for (;;)
+    {
+      /* Runs of plain characters outside of escapes are copied as is.
+       * Stay within the limits, so errors happen at the same place.
+       */
+      run	= IN.buf+IN.pos;
+      n		= b->esc ? 0 : K.simple(run, IN.fill-IN.pos);
+      if (limit.key && n > limit.key-len)
+        n	= limit.key-len;
+      if (limit.name && pre+b->pos+n > limit.name)
+        n	= pre+b->pos < limit.name ? limit.name-pre-b->pos : 0;
+      if (n)
+        {
+          base_putn(b, run, n);
+          IN.pos	+= n;
+          len		+= n;
+          if (top)
+            for (i=0; i<n; i++)
+              route_put(run[i], 0);
+          continue;
+        }
+      if (top)
+        {
+          unget(c = ch());
+          esc	= c=='\\';
+        }
+      if ((c=uniget('"'))==EOF)
+        break;
+      if (limit.key && ++len > limit.key)
+        OOPS("key longer than %lu characters", limit.key);
+      base_escape(b, c);
+      if (limit.name && pre+b->pos > limit.name)
+        OOPS("name longer than %lu characters", limit.name);
+      if (top)
+        route_put(c, esc);
+    }
+  base_escape(b, EOF);
+  PROBE3(key, depth, b->buf, b->pos);
+  if (top)
+    route_key(b);
+
+  return b;
+}
+
+
+/**********************************************************************
+ * JSON datatypes
+ *********************************************************************/
+
+void j_value(BASE b);
+
+static void
+j_enter(void)
+{
+  if (++depth > limit.depth && limit.depth)
+    OOPS("nesting deeper than %lu", limit.depth);
+}
+
+static void j_limit(BASE b);
+
+static void
+j_string(BASE b)
+{
+  D("");
+  FATAL(b->next);
+  get_string(b);
+  D(" ret");
+}
+
+static void
+j_const(BASE b, const char *var)
+{
+  D("var=%s", var);
+  need(var);
+  base_fin(b);
+  if (raw)
+    raw_value(b, *var=='n' ? 'z' : 'b', var, strlen(var));
+  else
+    base_out(b, "$JSON_%s_", var);
+}
+
+static void
+j_object(BASE p)
+{
+  BASE	b	= base(p, B_OBJ);
+
+  j_enter();
+  D("(%d)", b->done);
+  if (p->type!=B_INDEX)
+    base_esc(b, '0', 2);
+  D("(%d)", b->done);
+
+  need("{");
+  while (!have('}'))
+    {
+      BASE	t;
+
+      if (base_done(b))
+        need(",");
+      D(" here2");
+      t	= get_key(b);
+      need(":");
+      FATAL(t->next);
+      D(" here3 %d", t->done);
+      j_value(t);
+      D(" here1");
+    }
+  if (!base_done(b))
+    {
+      base_fin(b);
+      if (raw)
+        raw_value(b, 'o', "{}", 2);
+      else
+        base_out(b, "$JSON_nothing_");
+    }
+  depth--;
+}
+
+static void
+j_array(BASE p)
+{
+  BASE			b	= base(p, B_ARR);
+  BASE			t	= 0;
+  unsigned long long	index	= 0;
+  int			dig	= 0, end = 0, top;
+
+  j_enter();
+  D("()");
+  need("[");
+  while (!have(']'))
+    {
+      /* like base_done(b), but keep the index node	*/
+      if (t)
+        {
+          base_cut(t);
+          if (t->done)
+            b->done	= 1;
+        }
+      if (b->done)
+        need(",");
+      top	= route_top(b);
+      if (!t)
+        {
+          t	= base_index(b, ++index);
+          end	= t->pos;
+          dig	= end-1;
+          name_limit(t);
+        }
+      else
+        {
+          end	= base_reindex(t, dig, end);
+          index++;
+          if (b->done)
+            base_print(b->top);
+        }
+      if (top)
+        route_index(t, index);
+      j_value(t);
+      if (limit.elements && index>=limit.elements && b->top->next==b)
+        j_limit(t);
+    }
+  if (!base_done(b))
+    {
+      base_fin(b);
+      if (raw)
+        raw_value(b, 'a', "[]", 2);
+      else
+        base_out(b, "$JSON_empty_");
+    }
+  depth--;
+  D(" ret");
+}
+
+static void
+j_number(BASE p)
+{
+  BASE	b = base(p, B_VAL);
+  D("()");
+  base_if(b, "-");
+
+  if (!base_if(b, "0"))
+    base_digits(b);	/* we know it is not 0	*/
+
+  if (base_if(b, "."))
+    base_digits(b);
+
+  if (base_if(b, "eE"))
+    {
+      base_if(b, "+-");
+      base_digits(b);
+    }
+  base_fin(b);
+  base_add(b, EOF);
+  D(" ret");
+}
+
+void
+j_value(BASE b)
+{
+  int	type;
+
+  D("()");
+  type	= peek();
+  PROBE2(value__start, type, depth);
+  switch (type)
+    {
+      case EOF:	OOPS("unexpected EOF");
+      case '{':	j_object(b);			break;
+      case '[':	j_array(b);			break;
+      case '"':	j_string(b);			break;
+      case 't':	j_const(b,	"true");	break;
+      case 'f':	j_const(b,	"false");	break;
+      case 'n':	j_const(b,	"null");	break;
+      default:	j_number(b);			break;
+    }
+  PROBE2(value__end, type, depth);
+  if (limit.values && values>=limit.values)
+    j_limit(b);
+  D(" ret");
+}
+
+/**********************************************************************
+ * Validation without output
+ *********************************************************************/
+
+/* This follows the same grammar as the JSON datatypes above,
+ * but nothing is output and no names are built.
+ * It is iterative, so deep nesting does not exhaust the stack.
+ *
+ * The fast paths work on the input block directly.
+ * Where the block ends or something is unusual they leave it
+ * to the generic functions, so errors come out at the same place.
+ */
+
+/* Like peek()	*/
+static inline char
+skip_peek(void)
+{
+  size_t	i = IN.pos;
+
+  if (i<IN.fill && !(kern_cls[IN.buf[i]] & K_WS))
+    return IN.buf[i];
+  for (; i<IN.fill && i-IN.pos<8 && (kern_cls[IN.buf[i]] & K_WS); i++);
+  if (i-IN.pos>=8)
+    i	+= K.ws(IN.buf+i, IN.fill-i);
+  IN.pos	= i;
+  return i<IN.fill ? IN.buf[i] : peek();
+}
+
+/* Like have()	*/
+static inline int
+skip_have(int c)
+{
+  if (skip_peek()!=c)
+    return 0;
+  IN.pos++;
+  return 1;
+}
+
+/* Like need()	*/
+static void
+skip_need(const char *s)
+{
+  size_t	n = strlen(s);
+
+  if (skip_peek()==*s && IN.fill-IN.pos>=n && !memcmp(IN.buf+IN.pos, s, n))
+    IN.pos	+= n;
+  else
+    need(s);
+}
+
+static size_t
+skip_dig(const unsigned char *p, const unsigned char *end)
+{
+  const unsigned char	*s = p;
+
+  while (p<end && (kern_cls[*p] & K_DIGIT))
+    p++;
+  return p-s;
+}
+
+/* Numbers within the block, returns 0 if not sure
+ */
+static int
+skip_num(void)
+{
+  const unsigned char	*p = IN.buf+IN.pos, *end = IN.buf+IN.fill;
+  size_t		n;
+
+  if (p<end && *p=='-')
+    p++;
+  if (p<end && *p=='0')
+    p++;
+  else if ((n = skip_dig(p, end))>0)
+    p	+= n;
+  else
+    return 0;
+  if (p<end && *p=='.')
+    {
+      if (!(n = skip_dig(++p, end)))
+        return 0;
+      p	+= n;
+    }
+  if (p<end && (*p=='e' || *p=='E'))
+    {
+      if (++p<end && (*p=='+' || *p=='-'))
+        p++;
+      if (!(n = skip_dig(p, end)))
+        return 0;
+      p	+= n;
+    }
+  if (p>=end)
+    return 0;
+  IN.pos	= p-IN.buf;
+  return 1;
+}
+
+static void
+skip_digits(void)
+{
+  if (in_if("0123456789")==EOF)
+    OOPS("number expected");
+  do
+    IN.pos	+= K.digit(IN.buf+IN.pos, IN.fill-IN.pos);
+  while (IN.pos >= IN.fill && in_if("0123456789")!=EOF);
+}
+
+static void
+skip_number(void)
+{
+  in_is('-', '-');
+  if (in_is('0', '0')==EOF)
+    skip_digits();
+  if (in_is('.', '.')!=EOF)
+    skip_digits();
+  if (in_is('e', 'E')!=EOF)
+    {
+      in_is('+', '-');
+      skip_digits();
+    }
+}
+
+static void
+skip_string(void)
+{
+  const unsigned char	*run;
+  skip_need("\"");
+  IN.pos	+= K.str(IN.buf+IN.pos, IN.fill-IN.pos);
+  if (IN.pos<IN.fill && IN.buf[IN.pos]=='"')
+    {
+      IN.pos++;
+      return;
+    }
+  while (in_run(&run) || uniget('"')!=EOF);
+}
+
+static void
+skip_key(void)
+{
+  skip_string();
+  skip_need(":");
+}
+
+/* Skip a value within level open containers, which count for --max-depth
+ */
+static void
+skip_value(unsigned long level)
+{
+  static char	*stack;
+  static size_t	max;
+  unsigned long	depth = 0;
+
+  for (;;)
+    {
+      switch (skip_peek())
+        {
+        case EOF:	OOPS("unexpected EOF");
+        case '"':	skip_string();	break;
+        case 't':	skip_need("true");	break;
+        case 'f':	skip_need("false");	break;
+        case 'n':	skip_need("null");	break;
+        default:	if (!skip_num()) skip_number();	break;
+
+        case '{':
+        case '[':
+          if (limit.depth && level+depth >= limit.depth)
+            OOPS("nesting deeper than %lu", limit.depth);
+          if (depth >= max)
+            {
+              stack	=  re_alloc(stack, max+BUFSIZ);
+              max	+= BUFSIZ;
+            }
+          stack[depth]	= IN.buf[IN.pos++]=='{' ? '}' : ']';
+          if (skip_have(stack[depth]))
+            break;
+          if (stack[depth++]=='}')
+            skip_key();
+          continue;
+        }
+
+      /* value done, close containers	*/
+      for (; depth && skip_have(stack[depth-1]); depth--);
+      if (!depth)
+        return;
+      skip_need(",");
+      if (stack[depth-1]=='}')
+        skip_key();
+    }
+}
+
+/* Finish the containers which are open up to b, innermost first
+ */
+static void
+skip_rest(BASE n, BASE b, unsigned long level)
+{
+  if (n->type==B_OBJ || n->type==B_ARR)
+    level++;
+  if (n!=b)
+    skip_rest(n->next, b, level);
+  if (n->type==B_OBJ)
+    while (!have('}'))
+      {
+        need(",");
+        skip_key();
+        skip_value(level);
+      }
+  if (n->type==B_ARR)
+    while (!have(']'))
+      {
+        need(",");
+        skip_value(level);
+      }
+}
+
+/**********************************************************************
+ * Shell to JSON
+ *********************************************************************/
+
+/* --reverse reads the output of json2sh (with the same PREFIX SEP LF)
+ * and writes the JSON again.
+ * Names are decoded into paths of keys and indexes.
+ * Only the path of the previous line is kept, so memory is O(depth),
+ * but the lines must come in the order json2sh writes them.
+ *
+ * Some things cannot be told apart in the output:
+ * Numbers become strings, unless --numbers turns all which look like numbers into numbers,
+ * and an empty key of an object in an array becomes the array element.
+ */
+struct rev_part
+  {
+    int			key;		/* else index	*/
+    unsigned long long	index;
+    struct gbuf		k;		/* key as JSON	*/
+  };
+
+struct rev_path
+  {
+    struct rev_part	*part;
+    int			n, max;
+  };
+
+static struct
+  {
+    int			on;
+    unsigned long	lines;
+    struct rev_path	path[2], *cur, *next;
+    struct gbuf		name, val;
+    int			num;		/* state of number, -1: string	*/
+    int			numbers;	/* --numbers	*/
+    unsigned char	u8[4];		/* incomplete UTF-8 sequence	*/
+    int			u8n;
+  } rev;
+
+/* JSON escape a character into s (32 bytes), returns the length.
+ * Characters below 256 are bytes:  Valid UTF-8 sequences are copied,
+ * all other bytes become \u00XX, so the JSON stays valid.
+ * An incomplete sequence is kept in rev.u8, EOF flushes it.
+ */
+static int
+rev_esc(char *s, int c)
+{
+  static const unsigned char	lo[] = { 0x80, 0xa0, 0x80, 0x80, 0x90, 0x80 }, hi[] = { 0xbf, 0xbf, 0xbf, 0x9f, 0xbf, 0x8f };
+  int				n = 0, i, need;
+
+  if (rev.u8n)
+    {
+      i		= *rev.u8<0xe0 ? 0 : *rev.u8==0xe0 ? 1 : *rev.u8==0xed ? 3 : *rev.u8<0xf0 ? 2 : *rev.u8==0xf0 ? 4 : *rev.u8<0xf4 ? 2 : 5;
+      need	= *rev.u8<0xe0 ? 2 : *rev.u8<0xf0 ? 3 : 4;
+      if (rev.u8n>1 ? c>=0x80 && c<0xc0 : c>=lo[i] && c<=hi[i])
+        {
+          rev.u8[rev.u8n++]	= c;
+          if (rev.u8n < need)
+            return 0;
+          memcpy(s, rev.u8, need);
+          rev.u8n	= 0;
+          return need;
+        }
+      for (i=0; i<rev.u8n; i++)
+        n	+= snprintf(s+n, 7, "\\u%04x", rev.u8[i]);
+      rev.u8n	= 0;
+    }
+  switch (c)
+    {
+    case EOF:	return n;
+    case '"':	return n + snprintf(s+n, 3, "\\\"");
+    case '\\':	return n + snprintf(s+n, 3, "\\\\");
+    case '\b':	return n + snprintf(s+n, 3, "\\b");
+    case '\f':	return n + snprintf(s+n, 3, "\\f");
+    case '\n':	return n + snprintf(s+n, 3, "\\n");
+    case '\r':	return n + snprintf(s+n, 3, "\\r");
+    case '\t':	return n + snprintf(s+n, 3, "\\t");
+    }
+  if (c>=0xc2 && c<=0xf4)
+    {
+      rev.u8[0]	= c;
+      rev.u8n	= 1;
+      return n;
+    }
+  if (c<0x20 || (c>=0x80 && c<256) || (c>=0xd800 && c<0xe000))
+    return n + snprintf(s+n, 7, "\\u%04x", c);
+  if (c<0x80)
+    {
+      s[n]	= c;
+      return n+1;
+    }
+  return n + utf8(s+n, c);
+}
+
+/* End the key of the last part
+ */
+static void
+rev_kend(void)
+{
+  char	tmp[32];
+
+  if (rev.u8n)
+    gbuf_put(&rev.next->part[rev.next->n-1].k, tmp, rev_esc(tmp, EOF));
+}
+
+static struct rev_part *
+rev_push(int key)
+{
+  struct rev_path	*p = rev.next;
+  struct rev_part	*r;
+
+  if (p->n >= p->max)
+    {
+      p->part	= re_alloc(p->part, (p->max+16) * sizeof *p->part);
+      memset(p->part+p->max, 0, 16 * sizeof *p->part);
+      p->max	+= 16;
+    }
+  rev_kend();
+  r		= &p->part[p->n++];
+  r->key	= key;
+  r->index	= 0;
+  r->k.len	= 0;
+  return r;
+}
+
+/* Key character, perhaps starting the key of an object in an array
+ */
+static void
+rev_key(unsigned c)
 {
-  BASE	tmp	= b->next;
+  char	tmp[32];
 
-  b->next	= base_freelist;
-  b->type	= B_UNSPEC;
+  if (!rev.next->n)
+    OOPS("name cannot start with a key");
+  if (!rev.next->part[rev.next->n-1].key)
+    rev_push(1);
+  gbuf_put(&rev.next->part[rev.next->n-1].k, tmp, rev_esc(tmp, c));
+}
 
-  base_freelist	= b;
-  return tmp;
+/* Object separator.
+ * Objects in arrays have none, so here it comes from an empty key.
+ */
+static void
+rev_obj(void)
+{
+  if (rev.next->n && !rev.next->part[rev.next->n-1].key)
+    rev_push(1);
+  rev_push(1);
 }
 
-/* Append some unicode character to our base.
+/* Decode the name, the reverse of base_escape() and base_esc()
  */
 static void
-base_put(BASE b, int c)
+rev_name(const char *s, const char *end)
 {
-  if (b->pos >= b->buflen)
+  static const char	hex[] = "zyxwusqpomlkjihg", esc[] = "a\ab\bc_d\177e\033f\fn\nr\rt\tv\v";
+  const char		*h, *l, *e;
+  unsigned		cp = 0, plane = 0;
+  int			mode = 0, fresh = 0;
+
+  rev.next->n	= 0;
+  while (s<end)
     {
-      b->buflen	+= BUFSIZ;
-      b->buf	=  re_alloc(b->buf, b->buflen);
+      switch (mode)
+        {
+        case 0:	/* plain	*/
+          if (*s!='_')
+            {
+              if (!isalnum(*s))
+                OOPS("bad name");
+              rev_key(*s++);
+            }
+          else if (++s<end && *s=='_')
+            rev_key(*s++);
+          else if (s<end && *s>='1' && *s<='9')
+            {
+              rev_push(0);
+              mode	= 1;
+            }
+          else if (s<end && *s=='0')
+            {
+              rev_obj();
+              s++;
+              mode	= 2;
+            }
+          else if (s<end && isalpha(*s))
+            {
+              mode	= 3;
+              fresh	= 1;
+            }
+          else
+            OOPS("bad name");
+          continue;
+
+        case 1:	/* index	*/
+          if (isdigit(*s))
+            {
+              rev.next->part[rev.next->n-1].index	= rev.next->part[rev.next->n-1].index*10 + *s++ - '0';
+              continue;
+            }
+          if (*s=='_')
+            break;
+          mode	= 3;	/* escaped key of an object in the array	*/
+          continue;
+
+        case 2:	/* after object separator	*/
+          if (*s=='_')
+            break;
+          if (*s=='0')
+            {
+              rev_obj();
+              s++;
+              continue;
+            }
+          mode	= 3;
+          continue;
+
+        default:	/* escapes	*/
+          if (*s=='_')
+            break;
+          if (*s=='0')
+            {
+              rev_obj();
+              s++;
+              mode	= 2;
+              continue;
+            }
+          /* When the code plane starts the escapes, base_esc_end() forgets it again	*/
+          if (*s>='A' && *s<='Z')
+            {
+              for (plane=0; s<end && *s>='A' && *s<='Z'; s++)
+                plane	= plane*26 + *s-'A';
+              cp	= fresh ? 0 : plane;
+              fresh	= 0;
+              continue;
+            }
+          fresh	= 0;
+          if ((h=memchr(hex, *s, 16))!=0 && s+1<end && (l=memchr(hex, s[1], 16))!=0)
+            {
+              rev_key(plane<<8 | (h-hex)<<4 | (l-hex));
+              plane	= cp;
+              s	+= 2;
+              continue;
+            }
+          for (e=esc; *e && *e!=*s; e+=2);
+          if (!*e)
+            OOPS("bad name");
+          rev_key((unsigned char)e[1]);
+          s++;
+          continue;
+        }
+      /* '_' ends the mode	*/
+      s++;
+      mode	= 0;
+      cp	= 0;
+      plane	= 0;
     }
-  b->buf[b->pos++]	= c;
-  if (b->type != B_VAL)
-    outc(c);
+  if (mode)
+    OOPS("bad name");
+  rev_kend();
 }
 
-static void
-base_esc_end(BASE b)
+static int
+rev_same(const struct rev_part *a, const struct rev_part *b)
 {
-  D("(%d)", b->esc);
-  if (b->esc)
-    base_put(b, '_');
-  b->esc	= 0;
-  b->cp		= 0;
+  if (a->key != b->key)
+    return 0;
+  if (!a->key)
+    return a->index == b->index;
+  return a->k.len == b->k.len && !memcmp(a->k.buf, b->k.buf, a->k.len);
 }
 
-/* actually, this is a hack	*/
-static BASE
-base_child(BASE p, BASE b)
+/* Start a member of a container, prev is the member before
+ */
+static void
+rev_member(const struct rev_part *p, const struct rev_part *prev)
 {
-  FATAL(b->type==B_UNSPEC);
-  if (p)
-    {
-      FATAL(b==p);
-      FATAL(p->type==B_UNSPEC);
-      FATAL(p->next && p->next!=b);
-      p->next	= b;
-      b->top	= p->top;
-      if (b->done)	/* cannot happen, but perhaps in future	*/
-        p->done	= 1;
-
-      /* finish building variable name when value node follows	*/
-      if (b->type == B_VAL)
-        base_esc_end(p);
+  unsigned long long	i;
 
-      /* copy codepage and esc mode from parent	*/
-      b->esc	= p->esc;
-      b->cp	= p->cp;
+  if (p->key)
+    {
+      outc('"');
+      outn(p->k.buf, p->k.len);
+      outn("\":", 2);
+      return;
     }
-  FATAL(b->next);
-  return b;
+  i	= prev ? prev->index : 0;
+  if (p->index <= i)
+    OOPS("index %llu out of order", p->index);
+  /* missing elements, for example from --route	*/
+  while (++i < p->index)
+    outn("null,", 5);
 }
 
-static BASE
-base_new(BASE p, enum base_type type)
+/* Close what the previous path has left over and open what the next path needs
+ */
+static void
+rev_path(void)
 {
-  BASE	b;
+  const struct rev_path	*o = rev.cur, *n = rev.next;
+  int			m, j;
 
-  FATAL(p && p->type==B_UNSPEC);
+  for (m=0; m<o->n && m<n->n && rev_same(&o->part[m], &n->part[m]); m++);
+  if (rev.lines++)
+    {
+      if (m==o->n || m==n->n || o->part[m].key != n->part[m].key)
+        OOPS("name conflicts with the name before");
+      for (j=o->n; --j>m; )
+        outc(o->part[j].key ? '}' : ']');
+      outc(',');
+      rev_member(&n->part[m], &o->part[m]);
+    }
+  else
+    m	= -1;
+  for (j=m+1; j<n->n; j++)
+    {
+      outc(n->part[j].key ? '{' : '[');
+      rev_member(&n->part[j], NULL);
+    }
+}
 
-  if (!base_freelist)
-    base_freelist	= alloc0(sizeof *base_freelist);
+/* Number parser, returns the next state or -1
+ */
+static int
+rev_num(int s, unsigned c)
+{
+  switch (s)
+    {
+    case 0:	if (c=='-') return 1;	/* fallthrough	*/
+    case 1:	return c=='0' ? 2 : c>='1' && c<='9' ? 3 : -1;
+    case 3:	if (c>='0' && c<='9') return 3;	/* fallthrough	*/
+    case 2:	return c=='.' ? 4 : c=='e' || c=='E' ? 6 : -1;
+    case 4:	return c>='0' && c<='9' ? 5 : -1;
+    case 5:	return c>='0' && c<='9' ? 5 : c=='e' || c=='E' ? 6 : -1;
+    case 6:	if (c=='+' || c=='-') return 7;	/* fallthrough	*/
+    case 7:
+    case 8:	return c>='0' && c<='9' ? 8 : -1;
+    }
+  return -1;
+}
 
-  b		= base_freelist;
-  base_freelist	= b->next;
+/* Value character.
+ * As long as it looks like a number it is kept, else it is a string.
+ */
+static void
+rev_vchar(unsigned c)
+{
+  char		tmp[32];
+  size_t	i;
 
-  FATAL(b->type!=B_UNSPEC);
+  if (rev.num >= 0)
+    {
+      if ((rev.num = rev_num(rev.num, c)) >= 0)
+        {
+          tmp[0]	= c;
+          gbuf_put(&rev.val, tmp, 1);
+          return;
+        }
+      outc('"');
+      for (i=0; i<rev.val.len; i++)
+        outn(tmp, rev_esc(tmp, (unsigned char)rev.val.buf[i]));
+    }
+  outn(tmp, rev_esc(tmp, c));
+}
 
-  /* CAVEAT!  When adding new properties to BASE
-   * be sure to initialize them here!
-   */
-  b->next	= 0;
-  b->top	= b;
-  b->type	= type;
-  b->done	= 0;
-  b->esc	= 0;
-  b->cp		= 0;
-  b->value	= 0;
-  b->pos	= 0;
-  /* buflen and buf kept	*/
+static void
+rev_vend(void)
+{
+  size_t	i;
+  char		tmp[32];
 
-  return base_child(p, b);
+  switch (rev.num)
+    {
+    case 2:
+    case 3:
+    case 5:
+    case 8:
+      if (rev.numbers)
+        {
+          outn(rev.val.buf, rev.val.len);
+          return;
+        }
+      /* fallthrough	*/
+    default:
+      outc('"');
+      for (i=0; i<rev.val.len; i++)
+        outn(tmp, rev_esc(tmp, (unsigned char)rev.val.buf[i]));
+      break;
+    case -1:
+      break;
+    }
+  outn(tmp, rev_esc(tmp, EOF));
+  outc('"');
 }
 
-/* Cut the remaining base->next pointers.
- * This is because we are lazy.
- * We create base(parent), but we do not free it.
- *
- * Due to recursion, we know the sub-thing is no more needed,
- * so we can give it back to the pool.
+/* The reverse of oute()
  */
-static void
-base_cut(BASE p)
+static unsigned
+rev_unescape(void)
 {
-  BASE	b;
+  int	c;
 
-  if (p)
+  switch (c=ch())
     {
-      for (b=p->next; b; b=base_free(b))
-        if (b->done)
-          p->done	= 1;
-      p->next	= 0;
+    case '\'':
+    case '\\':	return c;
+    case 'a':	return '\a';
+    case 'b':	return '\b';
+    case 'e':
+    case 'E':	return '\033';
+    case 'f':	return '\f';
+    case 'n':	return '\n';
+    case 'r':	return '\r';
+    case 't':	return '\t';
+    case 'v':	return '\v';
+    case 'x':	return hexget(0, hexget(4, 0));
+    case 'u':	return hexget(0, hexget(4, hexget(8, hexget(12, 0))));
+    case 'U':	return hexget(0, hexget(4, hexget(8, hexget(12, hexget(16, hexget(20, hexget(24, hexget(28, 0))))))));
     }
+  OOPSc(c, "unknown escape sequence");
+  return 0;
 }
 
-static int
-base_done(BASE b)
+/* Value offloaded by --offload
+ */
+static void
+rev_file(void)
 {
-  base_cut(b);
-  return b->done;
+  char		tmp[BUFSIZ];
+  ssize_t	got, i;
+  int		fd, c;
+
+  rev.name.len	= 0;
+  if (ch()!='\'')
+    OOPS("' expected");
+  while ((c=ch())!='\'')
+    {
+      tmp[0]	= c;
+      gbuf_put(&rev.name, tmp, 1);
+    }
+  gbuf_put(&rev.name, "", 1);
+  if ((fd = open(rev.name.buf, O_RDONLY))<0)
+    OOPS("cannot open %s", rev.name.buf);
+  rev.num	= -1;
+  outc('"');
+  while ((got = read(fd, tmp, sizeof tmp))!=0)
+    {
+      if (got<0 && errno!=EINTR)
+        OOPS("read error on %s", rev.name.buf);
+      for (i=0; i<got; i++)
+        rev_vchar((unsigned char)tmp[i]);
+    }
+  close(fd);
 }
 
-/* Print out (repeat) the SHell variable name up to here
- */
 static void
-base_print(BASE b)
+rev_value(void)
 {
-  D("(%p %d)", b, b->type);
-  nl();
-  for (; b; b=b->next)
+  static const char	*consts[] = { "JSON_true_", "true", "JSON_false_", "false", "JSON_null_", "null", "JSON_empty_", "[]", "JSON_nothing_", "{}", 0 };
+  const char		**k;
+  char			tmp[16];
+  int			c, i;
+
+  rev.num	= 0;
+  rev.val.len	= 0;
+  c	= get();
+  if (c!='$')
+    rev_path();
+  switch (c)
     {
-      outn(b->buf, b->pos);
-      b->done	= 0;
+    case '\'':
+      while ((c=ch())!='\'')
+        rev_vchar(c);
+      break;
+
+    case '$':
+      if ((c=get())=='\'')
+        {
+          rev_path();
+          while ((c=ch())!='\'')
+            rev_vchar(c=='\\' ? rev_unescape() : c);
+          break;
+        }
+      unget(c);
+      for (i=0; (c=get())!=EOF && (isalnum(c) || c=='_') && i<sizeof tmp-1; tmp[i++]=c);
+      unget(c);
+      tmp[i]	= 0;
+      /* The object separator of an empty object is printed before it is known to be empty	*/
+      if (!strcmp(tmp, "JSON_nothing_") && rev.next->n && rev.next->part[rev.next->n-1].key && !rev.next->part[rev.next->n-1].k.len)
+        rev.next->n--;
+      rev_path();
+      for (k=consts; *k && strcmp(*k, tmp); k+=2);
+      if (*k)
+        {
+          outn(k[1], strlen(k[1]));
+          return;
+        }
+      if (strcmp(tmp, "JSON_file_"))
+        OOPS("unknown value $%s", tmp);
+      rev_file();
+      break;
+
+    default:
+      while (c!=EOF && isalnum(c))
+        {
+          rev_vchar(c);
+          c	= get();
+        }
+      unget(c);
+      break;
     }
+  rev_vend();
 }
 
-/* Setup for a new value to print out
+/* Match PREFIX, SEP or LF
  */
-static BASE
-base(BASE p, enum base_type type)
+static void
+rev_need(const struct _buf *b, const char *what)
 {
-  D("(%p t=%d)", p, type);
-  base_cut(p);
+  size_t	i;
 
-  D(" x1");
-  if (p && p->done)
-    base_print(p->top);
+  for (i=0; i<b->len; i++)
+    if (ch() != (unsigned char)b->buf[i])
+      OOPS("%s expected", what);
+}
 
-  D(" x2");
-  return base_new(p, type);
+static void
+rev_main(void)
+{
+  struct rev_path	*tmp;
+  char			c;
+  int			j;
+
+  if (!SEP->len)
+    OOPS("--reverse needs a SEP");
+  rev.cur	= &rev.path[0];
+  rev.next	= &rev.path[1];
+  while ((j=get())!=EOF)
+    {
+      unget(j);
+      rev_need(PREF, "PREFIX");
+      for (rev.name.len=0; (j=get())!=EOF && (isalnum(j) || j=='_') && j!=(unsigned char)*SEP->buf; )
+        {
+          c	= j;
+          gbuf_put(&rev.name, &c, 1);
+        }
+      unget(j);
+      rev_need(SEP, "SEP");
+      rev_name(rev.name.buf, rev.name.buf+rev.name.len);
+      rev_value();
+      rev_need(LF, "LF");
+      tmp	= rev.cur;
+      rev.cur	= rev.next;
+      rev.next	= tmp;
+    }
+  if (!rev.lines)
+    OOPS("no values");
+  for (j=rev.cur->n; --j>=0; )
+    outc(rev.cur->part[j].key ? '}' : ']');
+  outc('\n');
+  OUT->open	= 0;
 }
 
+/**********************************************************************
+ * Follow mode
+ *********************************************************************/
+
+/* --follow FILE converts each record of a growing NDJSON file
+ * as soon as it is complete, like tail -F.
+ * The output of a record is collected and written at once.
+ * A bad record is reported and skipped up to the first newline after its start.
+ * Rotation (a new file under the name) and truncation are detected
+ * when the end is reached, a record cut by them is dropped.
+ * With --follow-pos POSFILE the offset after the last record is kept,
+ * so a restart continues there if it still is the same file.
+ * Line numbers in errors count from where reading started.
+ */
+static struct
+  {
+    const char		*path, *pos;
+    int			fd, pfd, ino, wd;
+    unsigned long long	start;		/* file offset of IN.off 0	*/
+    unsigned long long	rec, boff, lstart;	/* start of the record, of its block and IN.lstart there	*/
+    int			line;
+    BASE		root;
+    int			cut;		/* input was cut by rotation or truncation	*/
+    jmp_buf		jmp;
+  } follow = { NULL, NULL, -1, -1, -1, -1 };
+
 static void
-base_fin(BASE b)
+follow_watch(void)
 {
-  base_esc_end(b);
-  if (!b->done)
-    outb(SEP);
-  b->done	= 1;
+#ifdef __linux__
+  if (follow.wd>=0)
+    inotify_rm_watch(follow.ino, follow.wd);
+  follow.wd	= inotify_add_watch(follow.ino, follow.path, IN_MODIFY|IN_ATTRIB|IN_MOVE_SELF|IN_DELETE_SELF);
+#endif
 }
 
+/* Wait for something to happen to the file
+ */
 static void
-base_out(BASE b, const char *s, ...)
+follow_wait(void)
 {
-  va_list	list;
+#ifdef __linux__
+  char	ev[sizeof (struct inotify_event) + NAME_MAX + 1];
 
-  va_start(list, s);
-  vout(s, list);
-  va_end(list);
+  if (read(follow.ino, ev, sizeof ev) >= 0 || errno==EINTR)
+    return;
+#endif
+  usleep(100000);
 }
 
-/* Send character, perhaps switching in esc mode:
- * 0: plain characters (0-9 A-Z a-z)
- * 1: indexes (1-999999999999999999999)
- * 2: object separator _0_
- * 3: all other escapes
+/* Returns what happened to the file, if it is no more the one we read
+ */
+static const char *
+follow_moved(void)
+{
+  struct stat	st, fst;
+
+  if (fstat(follow.fd, &fst))
+    OOPS("cannot stat %s", follow.path);
+  if (fst.st_size < lseek(follow.fd, 0, SEEK_CUR))
+    {
+      lseek(follow.fd, 0, SEEK_SET);
+      return "truncation";
+    }
+  if (stat(follow.path, &st) || (st.st_ino==fst.st_ino && st.st_dev==fst.st_dev))
+    return 0;
+  close(follow.fd);
+  if ((follow.fd = open(follow.path, O_RDONLY))<0)
+    OOPS("cannot open %s", follow.path);
+  follow_watch();
+  return "rotation";
+}
+
+/* Replaces in_dec(), never returns EOF
  */
+static size_t
+follow_raw(unsigned char **buf)
+{
+  static unsigned char	*mem;
+  jmp_buf		*j = oops_jmp;
+  const char		*why;
+  ssize_t		got;
+
+  oops_jmp	= 0;
+  if (!mem)
+    mem	= alloc0(IN.size);
+  while ((got = read(follow.fd, mem, IN.size))<=0)
+    {
+      if (got<0)
+        {
+          if (errno!=EINTR)
+            OOPS("read error on %s", follow.path);
+          continue;
+        }
+      if ((why = follow_moved())==0)
+        {
+          follow_wait();
+          continue;
+        }
+      if (j)
+        fprintf(stderr, NAME ": %s: record dropped due to %s\n", follow.path, why);
+      IN.pos	= 0;
+      IN.fill	= 0;
+      IN.off	= 0;
+      IN.lstart	= 0;
+      IN.line	= 0;
+      follow.start	= 0;
+      follow.cut	= 1;
+      longjmp(follow.jmp, 1);
+    }
+  oops_jmp	= j;
+  *buf	= mem;
+  return got;
+}
+
 static void
-base_esc(BASE b, int c, int esc)
+follow_open(void)
 {
-  if (b->esc != esc && (b->esc & esc)==0)
+  unsigned long long	ino, off;
+  struct stat		st;
+  char			tmp[64];
+  ssize_t		got;
+  char			*dir, *s;
+
+  if ((follow.fd = open(follow.path, O_RDONLY))<0)
+    OOPS("cannot open %s", follow.path);
+  if (follow.pos)
     {
-      base_esc_end(b);
-      if (esc)
-        base_put(b, '_');
+      if ((follow.pfd = open(follow.pos, O_RDWR|O_CREAT, 0666))<0)
+        OOPS("cannot open %s", follow.pos);
+      if ((got = pread(follow.pfd, tmp, sizeof tmp-1, 0))<0 || fstat(follow.fd, &st))
+        OOPS("cannot read %s", follow.pos);
+      tmp[got]	= 0;
+      if (sscanf(tmp, "%llu %llu", &ino, &off)==2 && ino==st.st_ino && off<=st.st_size)
+        follow.start	= lseek(follow.fd, off, SEEK_SET);
     }
-  b->esc	= esc;
-  base_put(b, c);
+#ifdef __linux__
+  if ((follow.ino = inotify_init1(IN_CLOEXEC))<0)
+    OOPS("inotify_init1 failed");
+  follow_watch();
+
+  /* the directory tells about a new file under the name	*/
+  dir	= alloc0(strlen(follow.path)+2);
+  strcpy(dir, follow.path);
+  if ((s = strrchr(dir, '/'))!=0)
+    s[1]	= 0;
+  else
+    strcpy(dir, ".");
+  if (inotify_add_watch(follow.ino, dir, IN_CREATE|IN_MOVED_TO)<0)
+    OOPS("cannot watch %s", dir);
+#endif
 }
 
-/* literal output (variable name)
+/* Keep the offset after the record
  */
 static void
-base_set(BASE b, struct _buf *buf)
+follow_save(void)
 {
-  int i;
+  struct stat	st;
+  char		tmp[64];
+  int		n;
 
-  for (i=0; i<buf->len; i++)
-    base_esc(b, buf->buf[i], 0);
+  if (follow.pfd<0)
+    return;
+  if (fstat(follow.fd, &st))
+    OOPS("cannot stat %s", follow.path);
+  n	= snprintf(tmp, sizeof tmp, "%20llu %20llu\n", (unsigned long long)st.st_ino, follow.start + IN.off + IN.pos);
+  if (pwrite(follow.pfd, tmp, n, 0)!=n)
+    OOPS("write error on %s", follow.pos);
 }
 
-static BASE
-base_index(BASE p, int index)
+/* Continue after the first newline behind the start of the bad record.
+ * The parser may have read past that newline,
+ * so then the block in which the record started is read again.
+ */
+static void
+follow_skip(void)
 {
-  BASE	b = base(p, B_INDEX);
-  char	buf[200], *ptr;
+  if (follow.rec < IN.off)
+    {
+      if (lseek(follow.fd, follow.start + follow.boff, SEEK_SET) < 0)
+        OOPS("cannot seek %s", follow.path);
+      IN.off	= follow.boff;
+      IN.line	= follow.line;
+      IN.lstart	= follow.lstart;
+      IN.fill	= 0;
+    }
+  while (IN.off + IN.fill <= follow.rec)
+    {
+      IN.pos	= IN.fill;
+      in_fill();
+    }
+  IN.pos	= follow.rec - IN.off;
+  while (get()!='\n');
+}
 
-  base_esc_end(b);
-  snprintf(buf, sizeof buf, "%d", index);
-  for (ptr=buf; *ptr; )
-    base_esc(b, *ptr++, 1);
-  return b;
+static void
+follow_main(void)
+{
+  BASE	b;
+
+  follow_open();
+  in_dec	= follow_raw;
+  stdsink.grow	= 1;
+  oops		= 1;	/* OOPS() must not flush a bad record	*/
+  if (setjmp(follow.jmp))
+    {
+      /* forget the record	*/
+      oops_jmp	= 0;
+      for (b=follow.root; b; b=base_drop(b));
+      follow.root	= 0;
+      depth		= 0;
+      mem_free(stdsink.buf);
+      stdsink.buf	= 0;
+      stdsink.size	= 0;
+      stdsink.fill	= 0;
+      stdsink.open	= 0;
+      if (!follow.cut)
+        follow_skip();
+      follow.cut	= 0;
+    }
+  for (;;)
+    {
+      peek();
+      follow.rec	= IN.off + IN.pos;
+      follow.boff	= IN.off;
+      follow.line	= IN.line;
+      follow.lstart	= IN.lstart;
+      follow.root	= b = base_new(NULL, B_PREFIX);
+      base_set(b, PREF);
+      oops_jmp	= &follow.jmp;
+      j_value(b);
+      oops_jmp	= 0;
+      for (; b; b=base_free(b));
+      follow.root	= 0;
+      nl();
+      sink_flush(&stdsink);
+      follow_save();
+    }
 }
 
-static void
-base_hex(BASE b, int hex)
+/**********************************************************************
+ * Conversion server
+ *********************************************************************/
+
+/* --listen SOCKET N serves conversions on a Unix socket
+ * by a pool of N preforked workers, which accept() in turn.
+ * A worker keeps its buffers, name pool and decoders warm
+ * and caches the last few PREFIX/SEP/LF.
+ *
+ * --client SOCKET [PREFIX [SEP [LF]]] is a drop-in for the command line:
+ * It sends the number of arguments and the arguments (each NUL terminated)
+ * as a single SEQPACKET, with its stdin, stdout and stderr attached (SCM_RIGHTS).
+ * The worker converts like json2sh would, closes the descriptors
+ * and replies the return code as a single byte.
+ * Options are those of the server.
+ * Clients which send nothing for SRV_TIMEOUT seconds, be it the request
+ * or the input, are dropped, so they cannot block the pool.
+ */
+#define	SRV_MSG		65536
+#define	SRV_CACHE	8
+#define	SRV_TIMEOUT	60
+
+static void finish(void);
+
+static struct
+  {
+    const char		*path, *client;
+    int			workers, stop, save[3];
+    pid_t		*pid;
+    BASE		root;
+    jmp_buf		jmp;
+    char		msg[SRV_MSG];
+    struct
+      {
+        char		*raw;
+        size_t		len;
+        struct _buf	*pref, *sep, *lf;
+      }			cache[SRV_CACHE];
+    unsigned		next;
+  } srv;
+
+static int
+srv_socket(const char *path, struct sockaddr_un *sa)
 {
-  base_esc(b, "zyxwusqpomlkjihg"[hex&0xf], 3);
+  int	fd;
+
+  memset(sa, 0, sizeof *sa);
+  sa->sun_family	= AF_UNIX;
+  if (strlen(path) >= sizeof sa->sun_path)
+    OOPS("socket path too long: %s", path);
+  strcpy(sa->sun_path, path);
+  if ((fd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0))<0)
+    OOPS("cannot create socket");
+  return fd;
 }
 
+/* Set PREFIX SEP LF of the request, they usually are the same as before
+ */
 static void
-base_cp26(BASE b, unsigned cp)
+srv_args(const char *raw, size_t len)
 {
-  if (cp>25)
-    base_cp26(b, cp/26);
-  base_esc(b, "ABCDEFGHIJKLMNOPQRSTUVWXYZ"[cp%26], 3);
+  const char	*arg[3] = { "JSON_", "=", "\n" };
+  const char	*p;
+  unsigned	i, n;
+
+  for (i=0; i<SRV_CACHE; i++)
+    if (srv.cache[i].raw && srv.cache[i].len==len && !memcmp(srv.cache[i].raw, raw, len))
+      break;
+  if (i>=SRV_CACHE)
+    {
+      if (len<1 || raw[len-1] || (unsigned char)raw[0]>3)
+        OOPS("protocol error");
+      for (n=0, p=raw+1; p<raw+len; p+=strlen(p)+1)
+        {
+          if (n>=3)
+            OOPS("protocol error");
+          arg[n++]	= p;
+        }
+      i	= srv.next++ % SRV_CACHE;
+      mem_free(srv.cache[i].raw);
+      buf_free(srv.cache[i].pref);
+      buf_free(srv.cache[i].sep);
+      buf_free(srv.cache[i].lf);
+      memset(&srv.cache[i], 0, sizeof srv.cache[i]);
+      srv.cache[i].pref	= buf(arg[0]);
+      srv.cache[i].sep	= buf(arg[1]);
+      srv.cache[i].lf	= buf(arg[2]);
+      srv.cache[i].raw	= alloc0(len);
+      srv.cache[i].len	= len;
+      memcpy(srv.cache[i].raw, raw, len);
+    }
+  PREF	= srv.cache[i].pref;
+  SEP	= srv.cache[i].sep;
+  LF	= srv.cache[i].lf;
+  SEP_emitter();
+  LF_emitter();
 }
 
+/* Forget what the previous request left behind
+ */
 static void
-base_cp(BASE b, unsigned cp)
+srv_reset(void)
 {
-  if (b->cp==cp)
-    return;
-
-  b->cp	= cp;
-  base_cp26(b, cp);
+  IN.pos	= 0;
+  IN.fill	= 0;
+  IN.off	= 0;
+  IN.lstart	= 0;
+  IN.line	= 0;
+  in_dec	= in_sniff;
+  DEC.restlen	= 0;
+  DEC.eof	= 0;
+  DEC.end	= 0;
+  OUT		= &stdsink;
+  stdsink.fill	= 0;
+  stdsink.open	= 0;
+  values	= 0;
+  depth		= 0;
+  oops		= 0;
+  errno		= 0;
 }
 
 static int
-simple_value(int ch)
+srv_convert(const char *raw, size_t len)
 {
-  return (ch>='0' && ch<='9') || (ch>='A' && ch<='Z') || (ch>='a' && ch<='z');
+  BASE	b;
+
+  srv_reset();
+  if (setjmp(srv.jmp))
+    {
+      oops_jmp	= 0;
+      for (b=srv.root; b; b=base_drop(b));
+      srv.root	= 0;
+      return 23;
+    }
+  oops_jmp	= &srv.jmp;
+  srv_args(raw, len);
+  srv.root	= b = base_new(NULL, B_PREFIX);
+  base_set(b, PREF);
+  j_value(b);
+  if (peek()!=EOF)
+    OOPS("end of input expected");
+  finish();
+  oops_jmp	= 0;
+  for (; b; b=base_free(b));
+  srv.root	= 0;
+  return 0;
 }
 
 static void
-base_escape(BASE b, int ch)
+srv_request(int c)
 {
-  switch (ch)
+  union { struct cmsghdr h; char buf[CMSG_SPACE(3*sizeof (int))]; } cm;
+  struct iovec		iov = { srv.msg, sizeof srv.msg };
+  struct msghdr		mh;
+  struct cmsghdr	*h;
+  int			fd[3], i;
+  unsigned char		rc = 42;
+  ssize_t		got;
+
+  memset(&mh, 0, sizeof mh);
+  mh.msg_iov		= &iov;
+  mh.msg_iovlen		= 1;
+  mh.msg_control	= cm.buf;
+  mh.msg_controllen	= sizeof cm.buf;
+  while ((got = recvmsg(c, &mh, MSG_CMSG_CLOEXEC))<0 && errno==EINTR);
+  if (got<=0)
+    return;
+  h	= CMSG_FIRSTHDR(&mh);
+  if (h && h->cmsg_level==SOL_SOCKET && h->cmsg_type==SCM_RIGHTS && h->cmsg_len==CMSG_LEN(sizeof fd))
     {
-    case EOF:	return;
-    case '_':
-      /* perhaps delay a bit, to see if we enter or leave ->esc	*/
-      if (b->esc)
-        base_esc(b, 'c', 3);
-      else
+      memcpy(fd, CMSG_DATA(h), sizeof fd);
+      for (i=0; i<3; i++)
         {
-          base_esc(b, ch, 0);
-          base_esc(b, ch, 0);
+          dup2(fd[i], i);
+          close(fd[i]);
         }
-      return;
-
-    case '\a':	base_esc(b, 'a', 3);	return;
-    case '\b':	base_esc(b, 'b', 3);	return;
-    case '\177':base_esc(b, 'd', 3);	return;
-    case '\033':base_esc(b, 'e', 3);	return;
-    case '\f':	base_esc(b, 'f', 3);	return;
-    case '\n':	base_esc(b, 'n', 3);	return;
-    case '\r':	base_esc(b, 'r', 3);	return;
-    case '\t':	base_esc(b, 't', 3);	return;
-    case '\v':	base_esc(b, 'v', 3);	return;
-    }
-
-  if (simple_value(ch))
-    {
-      base_esc(b, ch, 0);
-      return;
+      if (!(mh.msg_flags & MSG_TRUNC))
+        rc	= srv_convert(srv.msg, got);
+      for (i=0; i<3; i++)
+        dup2(srv.save[i], i);
     }
-
-  base_cp(b, ch>>8);
-  base_hex(b, ch>>4);
-  base_hex(b, ch);
+  else if (h && h->cmsg_level==SOL_SOCKET && h->cmsg_type==SCM_RIGHTS)
+    for (i=0; CMSG_LEN(i*sizeof (int)) < h->cmsg_len; i++)
+      close(((int *)CMSG_DATA(h))[i]);
+  send(c, &rc, 1, MSG_NOSIGNAL);
 }
 
 static void
-base_add(BASE b, int ch)
+srv_worker(int s)
 {
-  if (ch == EOF)
-    switch (b->value)
-      {
-      case 0: outn(b->buf, b->pos); return;
-      case 1: outc('\''); outn(b->buf, b->pos);
-      default: outc('\''); return;
-      }
-  if (b->value<2 && b->pos < 255)
-    if ((b->value==0 && simple_value(ch)) || (b->value=1, ch>=32 && ch<=255 && ch!='\'' && ch!=127))
-      {
-        base_put(b, ch);
-        return;
-      }
-  if (b->value < 3)
+  struct timeval	tv = { SRV_TIMEOUT };
+  int			c, i;
+
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGPIPE, SIG_IGN);
+  for (i=0; i<3; i++)
+    if ((srv.save[i] = fcntl(i, F_DUPFD_CLOEXEC, 3))<0)
+      OOPS("cannot save fd %d", i);
+  IN.timeout	= SRV_TIMEOUT;
+  for (;;)
     {
-      int	i;
-
-      outn("$'", 2);
-      for (i=0; i<b->pos; i++)
-        oute((unsigned char)b->buf[i]);
+      if ((c = accept(s, NULL, NULL))<0)
+        {
+          if (errno!=EINTR && errno!=ECONNABORTED)
+            OOPS("accept failed");
+          continue;
+        }
+      setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+      srv_request(c);
+      close(c);
     }
-  b->value	= 3;
-  oute(ch);
 }
 
-static int
-base_if(BASE b, const char *chars)
+static pid_t
+srv_spawn(int s)
 {
-  int	c;
+  pid_t	pid;
 
-  c	= ch();
-  if (!strchr(chars, c))
+  if ((pid = fork())<0)
+    OOPS("fork failed");
+  if (!pid)
     {
-      ungetc(c, stdin);
-      return 0;
+      srv_worker(s);
+      exit(0);
     }
-  base_fin(b);
-  base_add(b, c);
-  return 1;
+  return pid;
 }
 
+static void srv_signal(int sig) { srv.stop = sig; }
+
 static int
-base_digit(BASE b)
+srv_main(void)
 {
-  return base_if(b, "0123456789");
+  struct sockaddr_un	sa;
+  struct sigaction	sig;
+  struct stat		st;
+  pid_t			pid;
+  int			s, i, status;
+
+  s	= srv_socket(srv.path, &sa);
+  /* a socket left behind is removed, but not one still served	*/
+  if (!lstat(srv.path, &st) && S_ISSOCK(st.st_mode))
+    {
+      if (!connect(s, (struct sockaddr *)&sa, sizeof sa))
+        OOPS("%s is served already", srv.path);
+      if (errno==ECONNREFUSED)
+        unlink(srv.path);
+      close(s);
+      s	= srv_socket(srv.path, &sa);
+    }
+  if (bind(s, (struct sockaddr *)&sa, sizeof sa) || listen(s, SOMAXCONN))
+    OOPS("cannot listen on %s", srv.path);
+
+  memset(&sig, 0, sizeof sig);
+  sig.sa_handler	= srv_signal;
+  sigaction(SIGTERM, &sig, NULL);
+  sigaction(SIGINT, &sig, NULL);
+
+  srv.pid	= alloc0(srv.workers * sizeof *srv.pid);
+  for (i=0; i<srv.workers; i++)
+    srv.pid[i]	= srv_spawn(s);
+  while (!srv.stop)
+    {
+      if ((pid = wait(&status))<0)
+        continue;
+      for (i=0; i<srv.workers && srv.pid[i]!=pid; i++);
+      if (i>=srv.workers)
+        continue;
+      fprintf(stderr, NAME ": worker %d died (status %d), restarting\n", (int)pid, status);
+      srv.pid[i]	= srv_spawn(s);
+    }
+  for (i=0; i<srv.workers; i++)
+    kill(srv.pid[i], SIGTERM);
+  while (wait(NULL)>0 || errno==EINTR);
+  unlink(srv.path);
+  return 0;
 }
 
-static void
-base_digits(BASE b)
+static int
+srv_client(int argc, char **argv)
 {
-  if (!base_digit(b))
-    OOPS("number expected");
-  while (base_digit(b));
+  union { struct cmsghdr h; char buf[CMSG_SPACE(3*sizeof (int))]; } cm;
+  struct sockaddr_un	sa;
+  struct gbuf		msg = { 0 };
+  struct iovec		iov;
+  struct msghdr		mh;
+  int			fd[3] = { 0, 1, 2 };
+  unsigned char		rc;
+  char			n = argc-1;
+  int			c, i;
+  ssize_t		got;
+
+  gbuf_put(&msg, &n, 1);
+  for (i=1; i<argc; i++)
+    gbuf_put(&msg, argv[i], strlen(argv[i])+1);
+  if (msg.len > SRV_MSG)
+    OOPS("arguments too long");
+
+  c	= srv_socket(srv.client, &sa);
+  if (connect(c, (struct sockaddr *)&sa, sizeof sa))
+    OOPS("cannot connect to %s", srv.client);
+
+  memset(&mh, 0, sizeof mh);
+  memset(&cm, 0, sizeof cm);
+  iov.iov_base		= msg.buf;
+  iov.iov_len		= msg.len;
+  mh.msg_iov		= &iov;
+  mh.msg_iovlen		= 1;
+  mh.msg_control	= cm.buf;
+  mh.msg_controllen	= sizeof cm.buf;
+  cm.h.cmsg_level	= SOL_SOCKET;
+  cm.h.cmsg_type	= SCM_RIGHTS;
+  cm.h.cmsg_len		= CMSG_LEN(sizeof fd);
+  memcpy(CMSG_DATA(&cm.h), fd, sizeof fd);
+  while (sendmsg(c, &mh, MSG_NOSIGNAL)<0)
+    if (errno!=EINTR)
+      OOPS("cannot send to %s", srv.client);
+
+  while ((got = read(c, &rc, 1))<0 && errno==EINTR);
+  if (got!=1)
+    OOPS("connection to %s lost", srv.client);
+  return rc;
 }
 
-
 /**********************************************************************
- * JSON helpers
+ * main
  *********************************************************************/
 
-/* if b!=NULL then assemble a string suitable for shell variable,
- * else assemble a string suitable for shell variable content.
+/* Options come before the positional arguments
  */
-static BASE
-get_string(BASE p)
-{
-  BASE	b = base(p, B_VAL);
-  int	c;
+struct opt
+  {
+    const char	*name, *args;
+    int		argc;
+    void	(*fn)(char **);
+    const char	*help;
+  };
 
-  base_fin(b);
-  D("");
-  need("\"");
-  while ((c=uniget('"'))!=EOF)
-    base_add(b, c);
-  base_add(b, EOF);
-  D(" ret");
+static unsigned long
+opt_num(const char *s)
+{
+  char		*end;
+  unsigned long	n;
 
-  return b;
+  n	= strtoul(s, &end, 0);
+  if (end==s || *end)
+    OOPS("number expected: %s", s);
+  return n;
 }
 
-static BASE
-get_key(BASE p)
+/* For limits where 0 would be unlimited by accident	*/
+static unsigned long
+opt_count(const char *s)
 {
-  BASE	b = base(p, B_KEY);
-  int	c;
+  unsigned long	n;
 
-  need("\"");
-  while ((c=uniget('"'))!=EOF)
-    base_escape(b, c);
-  base_escape(b, EOF);
-
-  return b;
+  if (!(n = opt_num(s)))
+    OOPS("number above 0 expected: %s", s);
+  return n;
 }
 
-
-/**********************************************************************
- * JSON datatypes
- *********************************************************************/
-
-void j_value(BASE b);
-
+/* 0 is unlimited	*/
 static void
-j_string(BASE b)
+opt_bulk(const char *s, int assoc)
 {
-  D("");
-  FATAL(b->next);
-  get_string(b);
-  D(" ret");
+  bulk.max	= opt_num(s);
+  if (!bulk.max)
+    bulk.max--;
+  bulk.assoc	= assoc;
 }
 
-static void
-j_const(BASE b, const char *var)
+static void opt_route(char **argv) { route_add(argv[0], argv[1]); }
+static void opt_offload(char **argv) { offload_max = opt_num(argv[0]); offload_dir = argv[1]; }
+static void opt_diff(char **argv) { diff.path = argv[0]; }
+static void opt_pipeline(char **argv) { pipelined = 1; }
+static void opt_limit_values(char **argv) { limit.values = opt_count(argv[0]); }
+static void opt_limit_elements(char **argv) { limit.elements = opt_count(argv[0]); }
+static void opt_validate_tail(char **argv) { limit.tail = 1; }
+static void opt_max_key(char **argv) { limit.key = opt_num(argv[0]); }
+static void opt_max_name(char **argv) { limit.name = opt_num(argv[0]); }
+static void opt_max_depth(char **argv) { limit.depth = opt_num(argv[0]); }
+static void opt_max_heap(char **argv) { MEM.max = opt_num(argv[0]); }
+static void opt_stats(char **argv) { MEM.stats = 1; }
+static void opt_assoc(char **argv) { opt_bulk(argv[0], 1); }
+static void opt_declare(char **argv) { opt_bulk(argv[0], 0); }
+static void opt_reverse(char **argv) { rev.on = 1; }
+static void opt_numbers(char **argv) { rev.numbers = 1; }
+static void opt_follow(char **argv) { follow.path = argv[0]; }
+static void opt_follow_pos(char **argv) { follow.pos = argv[0]; }
+static void opt_listen(char **argv) { srv.path = argv[0]; srv.workers = opt_num(argv[1]); }
+static void opt_client(char **argv) { srv.client = argv[0]; }
+static void opt_raw(char **argv) { raw = 1; }
+static void opt_check(char **argv) { check = 1; }
+
+static struct opt opts[] =
+  {
+    { "--route",	"SPEC FILE",	2, opt_route,	"send top-level element SPEC to FILE (may be repeated)\n"
+                                                        "\t\tSPEC is .KEY for an object key, N or N-M or N- for array indexes\n"
+                                                        "\t\tFILE can be &N for a file descriptor.  Unrouted elements go to stdout" },
+    { "--offload",	"N DIR",	2, opt_offload,	"strings longer than N bytes are written to a new file in DIR\n"
+                                                        "\t\tthe value then is $JSON_file_'DIR/" NAME ".XXXXXX'" },
+    { "--diff",		"FILE",		1, opt_diff,	"only output what changed since the snapshot FILE, and unset what vanished\n"
+                                                        "\t\tFILE is replaced by the new snapshot on success" },
+    { "--limit-values",	"N",		1, opt_limit_values, "stop after N values were output" },
+    { "--limit-elements", "N",		1, opt_limit_elements, "stop after N elements of the top-level array" },
+    { "--validate-tail", "",		0, opt_validate_tail, "after a limit, check the rest of the input without output" },
+    { "--max-key",	"N",		1, opt_max_key,	"fail on keys longer than N characters" },
+    { "--max-name",	"N",		1, opt_max_name, "fail on names longer than N characters" },
+    { "--max-depth",	"N",		1, opt_max_depth, "fail on nesting deeper than N" },
+    { "--max-heap",	"N",		1, opt_max_heap, "fail if more than N bytes of memory are needed" },
+    { "--stats",	"",		0, opt_stats,	"report values and peak memory to stderr" },
+    { "--pipeline",	"",		0, opt_pipeline, "read and write in separate threads, so parsing does not wait for I/O" },
+    { "--assoc",	"N",		1, opt_assoc,	"output declare -A PREFIX=( [name]=value .. ) with at most N (0: all) entries each\n"
+                                                        "\t\tthe top-level value is [0], PREFIX must be a variable name" },
+    { "--declare",	"N",		1, opt_declare,	"output declare PREFIXname=value .. with at most N (0: all) entries each" },
+    { "--reverse",	"",		0, opt_reverse,	"read the output of " NAME " (with the same PREFIX SEP LF) and write JSON\n"
+                                                        "\t\tall values but true false null [] {} become strings" },
+    { "--numbers",	"",		0, opt_numbers,	"with --reverse, strings which look like numbers become numbers" },
+    { "--follow",	"FILE",		1, opt_follow,	"convert each record of the growing NDJSON FILE when it is complete, like tail -F\n"
+                                                        "\t\tbad records are reported and skipped" },
+    { "--follow-pos",	"POSFILE",	1, opt_follow_pos, "keep the offset after the last record in POSFILE to continue there" },
+    { "--check",	"",		0, opt_check,	"only check the input, without output.  Return 0 if it is valid JSON, else 23" },
+    { "--raw",		"",		0, opt_raw,	"output records NAME TYPE LEN\\n followed by LEN bytes of the unquoted value and \\n\n"
+                                                        "\t\tTYPE is s n b z a o for string number true/false null [] {}" },
+    { "--listen",	"SOCKET N",	2, opt_listen,	"serve conversions on the Unix SOCKET with N preforked workers" },
+    { "--client",	"SOCKET",	1, opt_client,	"convert with the server on SOCKET, the options are those of the server" },
+    { 0 }
+  };
+
+static int
+usage(void)
 {
-  D("var=%s", var);
-  need(var);
-  base_fin(b);
-  base_out(b, "$JSON_%s_", var);
+  struct opt	*o;
+
+  fprintf(stderr, "Usage: %s [options] [--] [PREFIX [SEP [LF]]]\n"
+          "\t\tVersion " VERSION " from " GITDATE " (" GITCOMMIT ")\n"
+          "\tConvert any JSON into lines readable by shell.\n"
+          "\tdefault: PREFIX='JSON_' SEP='=' LF='\\n'\n"
+          "\tPREFIX/SEP/LF are de-escaped if they start with '\\'.\n"
+          "\t\t\\i to ignore the initial '\\'.\n"
+          "\t\t\\c to ignore the rest of the string.\n"
+          "\t\t\\C to copy the rest of the string as-is.\n"
+          "\tExamples:\n"
+          "\t\tUse $ARG from env as-is: '\\C'\"$ARG\"\n"
+          "\t\tWrite ARGs like '-\\r\\n' as '\\i''-\\r\\n'\n"
+          "\t\tjson2sh <<< '[ true, false, null, [], {} ]'\n"
+          "\tOptions:\n"
+          , NAME);
+  for (o=opts; o->name; o++)
+    fprintf(stderr, "\t%s %s\n\t\t%s\n", o->name, o->args, o->help);
+  return 42;
 }
 
 static void
-j_object(BASE p)
+bulk_setup(int argc)
 {
-  BASE	b	= base(p, B_OBJ);
-
-  D("(%d)", b->done);
-  if (p->type!=B_INDEX)
-    base_esc(b, '0', 2);
-  D("(%d)", b->done);
-
-  need("{");
-  while (!have('}'))
-    {
-      BASE	t;
+  const char	*s;
 
-      if (base_done(b))
-        need(",");
-      D(" here2");
-      t	= get_key(b);
-      need(":");
-      FATAL(t->next);
-      D(" here3 %d", t->done);
-      j_value(t);
-      D(" here1");
-    }
-  if (!base_done(b))
+  if (argc>2)
+    OOPS("SEP and LF cannot be given with --assoc or --declare");
+  LF	= buf(bulk.assoc ? "\n" : " ");
+  if (bulk.assoc)
     {
-      base_fin(b);
-      base_out(b, "$JSON_nothing_");
+      s	= PREF->buf;
+      if (!PREF->len || isdigit(*s))
+        OOPS("--assoc needs a variable name as PREFIX");
+      for (; s<PREF->buf+PREF->len; s++)
+        if (!isalnum(*s) && *s!='_')
+          OOPS("--assoc needs a variable name as PREFIX");
+      bulk.name	= PREF;
+      PREF	= buf("[");
+      SEP	= buf("]=");
     }
+  stdsink.eol	= bulk_eol;
+  bulk_begin();
 }
 
 static void
-j_array(BASE p)
+raw_setup(int argc)
 {
-  BASE	b	= base(p, B_ARR);
-  int		index=0;
-
-  D("()");
-  need("[");
-  while (!have(']'))
-    {
-      BASE	t;
-
-      if (base_done(b))
-        need(",");
-      t	= base_index(b, ++index);
-      j_value(t);
-    }
-  if (!base_done(b))
-    {
-      base_fin(b);
-      base_out(b, "$JSON_empty_");
-    }
-  D(" ret");
+  if (argc>2)
+    OOPS("SEP and LF cannot be given with --raw");
+  SEP	= buf(" ");
+  LF	= buf("\n");
 }
 
+/* Terminate all lines and flush
+ */
 static void
-j_number(BASE p)
+finish(void)
 {
-  BASE	b = base(p, B_VAL);
-  D("()");
-  base_if(b, "-");
-
-  if (!base_if(b, "0"))
-    base_digits(b);	/* we know it is not 0	*/
-
-  if (base_if(b, "."))
-    base_digits(b);
-
-  if (base_if(b, "eE"))
+  if (diff.path)
+    diff_end();
+  for (OUT=sinks; OUT; OUT=OUT->next)
     {
-      base_if(b, "+-");
-      base_digits(b);
+      nl();
+      if (OUT->eol==bulk_eol && !bulk.pending)
+        bulk_end();
+      sink_flush(OUT);
     }
-  base_fin(b);
-  base_add(b, EOF);
-  D(" ret");
+  wr_sync();
+  if (MEM.stats)
+    fprintf(stderr, NAME ": %lu values, peak memory %zu bytes, %s kernels\n", values, MEM.peak, K.name);
 }
 
-void
-j_value(BASE b)
+/* Limit reached:  Stop output,
+ * and perhaps check the tail of the input.
+ */
+static void
+j_limit(BASE b)
 {
-  D("()");
-  switch (peek())
+  finish();
+  if (limit.tail)
     {
-      case EOF:	OOPS("unexpected EOF");
-      case '{':	j_object(b);			break;
-      case '[':	j_array(b);			break;
-      case '"':	j_string(b);			break;
-      case 't':	j_const(b,	"true");	break;
-      case 'f':	j_const(b,	"false");	break;
-      case 'n':	j_const(b,	"null");	break;
-      default:	j_number(b);			break;
+      depth	= 0;
+      skip_rest(b->top, b, 0);
+      if (peek()!=EOF)
+        OOPS("end of input expected");
     }
-  D(" ret");
+  exit(0);
 }
 
-/**********************************************************************
- * main
- *********************************************************************/
-
 int
 main(int argc, char **argv)
 {
-  BASE	b;
+  int		nopts = 0;
+  BASE		b;
+
+  for (; argc>1 && argv[1][0]=='-'; argc--, argv++)
+    {
+      struct opt	*o;
 
-  if (argc>4 || (argc>1 && argv[1][0]=='-'))
+      if (!strcmp(argv[1], "--"))
+        {
+          argc--, argv++;
+          break;
+        }
+      for (o=opts; o->name && strcmp(o->name, argv[1]); o++);
+      if (!o->name || argc-2 < o->argc)
+        return usage();
+      o->fn(argv+2);
+      nopts++;
+      argc	-= o->argc;
+      argv	+= o->argc;
+    }
+  if (argc>4)
+    return usage();
+  if (srv.client)
     {
-      fprintf(stderr, "Usage: %s [PREFIX [SEP [LF]]]\n"
-              "\t\tVersion " VERSION " from " GITDATE " (" GITCOMMIT ")\n"
-              "\tConvert any JSON into lines readable by shell.\n"
-              "\tdefault: PREFIX='JSON_' SEP='=' LF='\\n'\n"
-              "\tPREFIX/SEP/LF are de-escaped if they start with '\\'.\n"
-              "\t\t\\i to ignore the initial '\\'.\n"
-              "\t\t\\c to ignore the rest of the string.\n"
-              "\t\t\\C to copy the rest of the string as-is.\n"
-              "\tExamples:\n"
-              "\t\tUse $ARG from env as-is: '\\C'\"$ARG\"\n"
-              "\t\tWrite ARGs like '-\\r\\n' as '\\i''-\\r\\n'\n"
-              "\t\tjson2sh <<< '[ true, false, null, [], {} ]'\n"
-              , NAME);
-      return 42;
+      if (nopts>1)
+        OOPS("--client cannot be combined with other options");
+      return srv_client(argc, argv);
     }
 
   PREF	= buf(argc>1 ? argv[1] : "JSON_");
   SEP	= buf(argc>2 ? argv[2] : "=");
   LF	= buf(argc>3 ? argv[3] : "\n");
 
+  /* all conflicts first, as the setup below may write output	*/
+  if (srv.path)
+    {
+      if (argc>1 || srv.workers<1)
+        return usage();
+      if (routes || diff.path || bulk.max || offload_dir || rev.on || follow.path || pipelined || check || limit.values || limit.elements)
+        OOPS("--listen cannot be combined with --route, --diff, --assoc, --declare, --offload, --reverse, --follow, --pipeline, --check or limits");
+    }
+  if (check && (routes || diff.path || bulk.max || offload_dir || rev.on || follow.path || raw || limit.values || limit.elements || limit.key || limit.name))
+    OOPS("--check cannot be combined with output options, --follow, limits, --max-key or --max-name");
+  if (follow.path && (routes || diff.path || bulk.max || offload_dir || rev.on || pipelined || limit.values || limit.elements))
+    OOPS("--follow cannot be combined with --route, --diff, --assoc, --declare, --offload, --reverse, --pipeline or limits");
+  if (rev.numbers && !rev.on)
+    OOPS("--numbers needs --reverse");
+  if (follow.pos && !follow.path)
+    OOPS("--follow-pos needs --follow");
+  if (limit.tail && !limit.values && !limit.elements)
+    OOPS("--validate-tail needs --limit-values or --limit-elements");
+  if (rev.on && (routes || diff.path || bulk.max || offload_dir))
+    OOPS("--reverse cannot be combined with --route, --diff, --assoc, --declare or --offload");
+  if (diff.path && routes)
+    OOPS("--diff cannot be combined with --route");
+  if (diff.path && (limit.values || limit.elements))
+    OOPS("--diff cannot be combined with --limit-values or --limit-elements");
+  if (raw && (diff.path || bulk.max || offload_dir || rev.on || srv.path))
+    OOPS("--raw cannot be combined with --diff, --assoc, --declare, --offload, --reverse or --listen");
+  if (bulk.max && (routes || diff.path))
+    OOPS("--assoc and --declare cannot be combined with --route or --diff");
+  if (!kern_select(getenv("JSON2SH_ISA")))
+    OOPS("JSON2SH_ISA=%s not supported", getenv("JSON2SH_ISA"));
+
+  if (bulk.max)
+    bulk_setup(argc);
+  if (raw)
+    raw_setup(argc);
+  SEP_emitter();
+  LF_emitter();
+
+  if (pipelined)
+    pipe_start();
+  if (srv.path)
+    return srv_main();
+  if (check)
+    {
+      skip_value(0);
+      if (peek()!=EOF)
+        OOPS("end of input expected");
+      finish();
+      return 0;
+    }
+  if (follow.path)
+    follow_main();
+  if (rev.on)
+    {
+      rev_main();
+      finish();
+      return 0;
+    }
+  if (routes)
+    OUT	= &discard;
+  if (diff.path)
+    diff_open(diff.path);
   b	= base_new(NULL, B_PREFIX);
   base_set(b, PREF);
   j_value(b);
   if (peek()!=EOF)
     OOPS("end of input expected");
-  if (base_done(b))
-    nl();
+  finish();
 
   return 0;
 }
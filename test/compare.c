@@ -0,0 +1,479 @@
+/* Differential testing of json2sh
+ *
+ * This Works is placed under the terms of the Copyright Less License,
+ * see file COPYRIGHT.CLL.  USE AT OWN RISK, ABSOLUTELY NO WARRANTY.
+ *
+ * compare N SEED JSON2SH [PREFIX [SEP [LF]]]
+ *
+ * feeds N generated documents through all variants of JSON2SH
+ * (each kernel with plain reads, --pipeline, trickled reads and gzip)
+ * and checks that stdout, stderr and the exit code are identical.
+ * The --check variants must give the same stderr and exit code without stdout,
+ * they only get --max-depth and are skipped with limits which are not validated.
+ * The first variant is the reference.
+ * Some documents are damaged, so the error paths are compared, too.
+ * On a mismatch the document is written to stdout to reproduce it.
+ * The throughput of each variant is reported to stderr.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#define	NAME	"compare"
+
+static void
+OOPS(const char *s)
+{
+  perror(s);
+  exit(23);
+}
+
+struct gbuf
+  {
+    char	*buf;
+    size_t	len, max;
+  };
+
+static void
+gbuf_grow(struct gbuf *b, size_t len)
+{
+  if (b->len+len > b->max)
+    {
+      b->max	= (b->len+len+BUFSIZ) / BUFSIZ * BUFSIZ;
+      if (!(b->buf = realloc(b->buf, b->max)))
+        OOPS("out of memory");
+    }
+}
+
+static void
+gbuf_put(struct gbuf *b, const char *s, size_t len)
+{
+  gbuf_grow(b, len);
+  memcpy(b->buf+b->len, s, len);
+  b->len	+= len;
+}
+
+struct cmp_variant
+  {
+    const char		*isa, *mode;
+    int			pipeline, trickle, gzip, check;
+    unsigned long long	bytes, ns;
+  };
+
+static struct
+  {
+    unsigned long	docs;
+    unsigned long long	seed, rnd;
+    const char		*prog;
+    struct gbuf	doc, in, out[2], ref[2];
+  } cmp;
+
+static unsigned long
+cmp_rnd(unsigned long n)
+{
+  cmp.rnd	^= cmp.rnd >> 12;
+  cmp.rnd	^= cmp.rnd << 25;
+  cmp.rnd	^= cmp.rnd >> 27;
+  return ((cmp.rnd * 2685821657736338717ULL) >> 33) % n;
+}
+
+static void
+cmp_puts(const char *s)
+{
+  gbuf_put(&cmp.doc, s, strlen(s));
+}
+
+static void
+cmp_putc(char c)
+{
+  gbuf_put(&cmp.doc, &c, 1);
+}
+
+static void
+cmp_ws(void)
+{
+  while (!cmp_rnd(3))
+    cmp_putc(" \t\r\n"[cmp_rnd(4)]);
+}
+
+/* Strings stress the quoting tiers and the escapes of names
+ */
+static void
+cmp_string(int max)
+{
+  static const char	*utf8[] = { "\xc3\xa4", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\xed\xa0\x80", "\xff" };
+  static const char	*esc[] = { "\\\"", "\\\\", "\\/", "\\b", "\\f", "\\n", "\\r", "\\t", "\\ud83d\\ude00", "\\u005f", "\\u0000" };
+  static const int	lens[] = { 0, 1, 2, 8, 100, 254, 255, 256, 1000 };
+  char	tmp[8];
+  int	i, n, mode;
+
+  n	= lens[cmp_rnd(sizeof lens / sizeof *lens)];
+  if (n > max)
+    n	= max;
+  mode	= cmp_rnd(4);
+  cmp_putc('"');
+  for (i=0; i<n; i++)
+    switch (mode ? cmp_rnd(mode==1 ? 3 : 9) : 0)
+      {
+      case 0:	cmp_putc("0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"[cmp_rnd(62)]);	break;
+      case 1:	cmp_putc(" !#$%&()*+,-.:;<=>?@[]^`{|}~"[cmp_rnd(28)]);	break;
+      case 2:	cmp_putc(cmp_rnd(2) ? '_' : '\'');	break;
+      case 3:	cmp_puts(esc[cmp_rnd(sizeof esc / sizeof *esc)]);	break;
+      case 4:	snprintf(tmp, sizeof tmp, "\\u%04lx", cmp_rnd(65536));	cmp_puts(tmp);	break;
+      case 5:	cmp_puts(utf8[cmp_rnd(sizeof utf8 / sizeof *utf8)]);	break;
+      case 6:	cmp_putc(1+cmp_rnd(31));	break;
+      case 7:	cmp_putc(127+cmp_rnd(129));	break;
+      default:	cmp_putc('0'+cmp_rnd(10));	break;
+      }
+  cmp_putc('"');
+}
+
+static void
+cmp_number(void)
+{
+  int	i;
+
+  if (cmp_rnd(2))
+    cmp_putc('-');
+  if (cmp_rnd(4))
+    for (cmp_putc('1'+cmp_rnd(9)), i=cmp_rnd(cmp_rnd(2) ? 5 : 300); --i>=0; cmp_putc('0'+cmp_rnd(10)));
+  else
+    cmp_putc('0');
+  if (!cmp_rnd(3))
+    for (cmp_putc('.'), i=cmp_rnd(20); i-->=0; cmp_putc('0'+cmp_rnd(10)));
+  if (!cmp_rnd(4))
+    for (cmp_putc("eE"[cmp_rnd(2)]), cmp_puts(cmp_rnd(2) ? "" : cmp_rnd(2) ? "+" : "-"), i=cmp_rnd(3); i-->=0; cmp_putc('0'+cmp_rnd(10)));
+}
+
+static void
+cmp_value(int level, size_t size)
+{
+  static const char	*consts[] = { "true", "false", "null" };
+  int			i, n;
+
+  cmp_ws();
+  switch (level<12 && cmp.doc.len<size ? cmp_rnd(6) : cmp_rnd(3))
+    {
+    case 0:	cmp_string(1000);	break;
+    case 1:	cmp_number();		break;
+    case 2:	cmp_puts(consts[cmp_rnd(3)]);	break;
+    case 3:
+    case 4:
+      cmp_putc('[');
+      for (n=cmp_rnd(cmp_rnd(4) ? 5 : 200), i=0; i<n; i++)
+        {
+          if (i)
+            cmp_putc(',');
+          cmp_value(level+1, size);
+        }
+      cmp_ws();
+      cmp_putc(']');
+      break;
+    default:
+      cmp_putc('{');
+      for (n=cmp_rnd(cmp_rnd(4) ? 5 : 100), i=0; i<n; i++)
+        {
+          if (i)
+            cmp_putc(',');
+          cmp_ws();
+          cmp_string(cmp_rnd(4) ? 10 : 300);
+          cmp_ws();
+          cmp_putc(':');
+          cmp_value(level+1, size);
+        }
+      cmp_ws();
+      cmp_putc('}');
+      break;
+    }
+  cmp_ws();
+}
+
+/* Damage some documents, so errors are compared, too
+ */
+static void
+cmp_damage(void)
+{
+  size_t	pos;
+
+  if (!cmp.doc.len || cmp_rnd(4))
+    return;
+  pos	= cmp_rnd(cmp.doc.len);
+  switch (cmp_rnd(4))
+    {
+    case 0:	cmp.doc.len	= pos;	break;
+    case 1:	cmp.doc.buf[pos]	= cmp_rnd(256);	break;
+    case 2:	cmp.doc.buf[pos]	= "{}[],:\"\\ 0eE-+.tfn"[cmp_rnd(19)];	break;
+    default:	memmove(cmp.doc.buf+pos, cmp.doc.buf+pos+1, cmp.doc.len-pos-1);	cmp.doc.len--;	break;
+    }
+}
+
+/* Options which are the same for all variants of a document
+ */
+static int
+cmp_options(char **args, char *tmp, size_t max)
+{
+  int	n = 0;
+
+  snprintf(tmp, max/2, "%lu", 1+cmp_rnd(cmp_rnd(2) ? 10 : 300));
+  snprintf(tmp+max/2, max-max/2, "%lu", 1+cmp_rnd(10));
+  switch (cmp_rnd(9))
+    {
+    case 0:	args[n++] = "--limit-values";	args[n++] = tmp;	break;
+    case 1:	args[n++] = "--limit-elements";	args[n++] = tmp;	args[n++] = "--validate-tail";	break;
+    case 2:	args[n++] = "--max-name";	args[n++] = tmp;	args[n++] = "--max-key";	args[n++] = tmp;	break;
+    case 3:	args[n++] = "--max-depth";	args[n++] = tmp;	break;
+    case 4:	args[n++] = "--max-depth";	args[n++] = tmp;	args[n++] = cmp_rnd(2) ? "--limit-values" : "--limit-elements";
+		args[n++] = tmp+max/2;	args[n++] = "--validate-tail";	break;
+    }
+  return n;
+}
+
+static void
+cmp_gzip(void)
+{
+#ifdef HAVE_ZLIB
+  z_stream	z;
+
+  memset(&z, 0, sizeof z);
+  if (deflateInit2(&z, 1+cmp_rnd(9), Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    OOPS("deflateInit2 failed");
+  cmp.in.len	= 0;
+  gbuf_grow(&cmp.in, deflateBound(&z, cmp.doc.len));
+  z.next_in	= (unsigned char *)cmp.doc.buf;
+  z.avail_in	= cmp.doc.len;
+  z.next_out	= (unsigned char *)cmp.in.buf;
+  z.avail_out	= cmp.in.max;
+  if (deflate(&z, Z_FINISH) != Z_STREAM_END)
+    OOPS("deflate failed");
+  cmp.in.len	= z.total_out;
+  deflateEnd(&z);
+#endif
+}
+
+/* Run one variant on the document, returns the exit code
+ */
+static int
+cmp_run(struct cmp_variant *v, char **args)
+{
+  const char		*in = v->gzip ? cmp.in.buf : cmp.doc.buf;
+  size_t		len = v->gzip ? cmp.in.len : cmp.doc.len;
+  struct pollfd		p[3];
+  struct timespec	t0, t1;
+  int			fd[6], i, n, status, first = 1;
+  char			tmp[BUFSIZ];
+  pid_t			pid;
+
+  for (i=0; i<6; i+=2)
+    if (pipe(fd+i))
+      OOPS("pipe failed");
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if ((pid = fork()) < 0)
+    OOPS("fork failed");
+  if (!pid)
+    {
+      dup2(fd[0], 0);
+      dup2(fd[3], 1);
+      dup2(fd[5], 2);
+      for (i=0; i<6; i++)
+        close(fd[i]);
+      setenv("JSON2SH_ISA", v->isa, 1);
+      signal(SIGPIPE, SIG_DFL);
+      execvp(cmp.prog, args);
+      _exit(127);
+    }
+  close(fd[0]);
+  close(fd[3]);
+  close(fd[5]);
+  fcntl(fd[1], F_SETFL, O_NONBLOCK);
+  p[0].fd	= fd[1];
+  p[1].fd	= fd[2];
+  p[2].fd	= fd[4];
+  cmp.out[0].len	= 0;
+  cmp.out[1].len	= 0;
+  while (p[0].fd>=0 || p[1].fd>=0 || p[2].fd>=0)
+    {
+      for (i=0; i<3; i++)
+        p[i].events	= i ? POLLIN : POLLOUT;
+      if (poll(p, 3, -1) < 0)
+        {
+          if (errno==EINTR)
+            continue;
+          OOPS("poll failed");
+        }
+      if (p[0].revents)
+        {
+          /* trickle starts with a few bytes alone, like a slow pipe, to split the magic	*/
+          n	= !v->trickle ? BUFSIZ*8 : first ? 1+cmp_rnd(3) : 1+cmp_rnd(1+cmp_rnd(BUFSIZ));
+          if (len && (n = write(p[0].fd, in, len < n ? len : n)) < 0 && (errno==EAGAIN || errno==EINTR))
+            continue;
+          if (v->trickle && first && n > 0)
+            usleep(2000);
+          first	= 0;
+          if (!len || n < 0)
+            {
+              close(p[0].fd);
+              p[0].fd	= -1;
+            }
+          else
+            {
+              in	+= n;
+              len	-= n;
+            }
+        }
+      for (i=1; i<3; i++)
+        if (p[i].revents)
+          {
+            if ((n = read(p[i].fd, tmp, sizeof tmp)) > 0)
+              gbuf_put(&cmp.out[i-1], tmp, n);
+            else if (!n || errno!=EINTR)
+              {
+                close(p[i].fd);
+                p[i].fd	= -1;
+              }
+          }
+    }
+  if (waitpid(pid, &status, 0) != pid)
+    OOPS("waitpid failed");
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  v->bytes	+= cmp.doc.len;
+  v->ns		+= (t1.tv_sec-t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 128+WTERMSIG(status);
+}
+
+/* JSON2SH refuses kernels the CPU does not support
+ */
+static int
+cmp_supported(const char *isa)
+{
+  struct cmp_variant	v = { isa, "probe" };
+  char			*args[] = { NAME, "--check", 0 };
+
+  cmp.doc.len	= 0;
+  cmp_puts("[]");
+  return !cmp_run(&v, args);
+}
+
+int
+main(int argc, char **argv)
+{
+  static const char			*isas[] = { "scalar", "sse42", "avx2", "avx512" };
+  static const struct cmp_variant	modes[] =
+    {
+      { 0, "read" },
+      { 0, "pipeline",	1 },
+      { 0, "trickle",	0, 1 },
+#ifdef HAVE_ZLIB
+      { 0, "gzip",	0, 0, 1 },
+      { 0, "gzip-trickle", 0, 1, 1 },
+#endif
+      { 0, "check",	0, 0, 0, 1 },
+      { 0, "check-trickle", 0, 1, 0, 1 },
+    };
+  struct cmp_variant	vars[sizeof modes / sizeof *modes * sizeof isas / sizeof *isas], *v;
+  char			*args[argc+10], *opts[8], tmp[30], *end;
+  unsigned long		doc;
+  int			i, j, n, nvars, rc, ref = 0;
+
+  if (argc<4 || argc>7)
+    {
+      fprintf(stderr, "Usage: %s N SEED JSON2SH [PREFIX [SEP [LF]]]\n", argv[0]);
+      return 42;
+    }
+  cmp.docs	= strtoul(argv[1], &end, 0);
+  if (end==argv[1] || *end)
+    return 42;
+  cmp.seed	= strtoull(argv[2], &end, 0);
+  if (end==argv[2] || *end)
+    return 42;
+  cmp.prog	= argv[3];
+  argc	-= 3;
+  argv	+= 3;
+
+  signal(SIGPIPE, SIG_IGN);
+  /* scalar/read comes first, so it is the reference	*/
+  nvars	= 0;
+  for (j=0; j<sizeof isas / sizeof *isas; j++)
+    if (cmp_supported(isas[j]))
+      for (i=0; i<sizeof modes / sizeof *modes; i++)
+        {
+          vars[nvars]		= modes[i];
+          vars[nvars++].isa	= isas[j];
+        }
+  if (!nvars)
+    {
+      fprintf(stderr, NAME ": %s does not run\n", cmp.prog);
+      return 23;
+    }
+  for (doc=0; doc<cmp.docs; doc++)
+    {
+      cmp.rnd		= (cmp.seed + doc + 1) * 0x9e3779b97f4a7c15ULL;
+      cmp.doc.len	= 0;
+      cmp_value(0, cmp_rnd(2) ? 1+cmp_rnd(1000) : 1+cmp_rnd(1<<(10+cmp_rnd(12))));
+      cmp_damage();
+      cmp_gzip();
+
+      n		= cmp_options(opts, tmp, sizeof tmp);
+      for (v=vars; v<vars+nvars; v++)
+        {
+          if (v->check && n && strcmp(opts[0], "--max-depth"))
+            continue;
+          /* --check only gets --max-depth, as the validated limits must not change what it finds	*/
+          i	= v->check && n ? 2 : n;
+          args[0]	= "json2sh";
+          memcpy(args+1, opts, i * sizeof *opts);
+          i++;
+          if (v->pipeline)
+            args[i++]	= "--pipeline";
+          if (v->check)
+            args[i++]	= "--check";
+          args[i++]	= "--";
+          memcpy(args+i, argv+1, (argc-1) * sizeof *argv);
+          args[i+argc-1]	= 0;
+
+          rc	= cmp_run(v, args);
+          if (v==vars)
+            {
+              ref	= rc;
+              for (i=0; i<2; i++)
+                {
+                  cmp.ref[i].len	= 0;
+                  gbuf_put(&cmp.ref[i], cmp.out[i].buf, cmp.out[i].len);
+                }
+              continue;
+            }
+          if (rc==ref
+              && (v->check ? !cmp.out[0].len : cmp.out[0].len==cmp.ref[0].len && !memcmp(cmp.out[0].buf, cmp.ref[0].buf, cmp.ref[0].len))
+              && cmp.out[1].len==cmp.ref[1].len && !memcmp(cmp.out[1].buf, cmp.ref[1].buf, cmp.ref[1].len))
+            continue;
+
+          fprintf(stderr, NAME ": document %lu of seed %llu: %s/%s differs from %s/%s (exit %d vs %d)\n",
+                  doc, cmp.seed, v->isa, v->mode, vars->isa, vars->mode, rc, ref);
+          if (n)
+            {
+              fprintf(stderr, NAME ": options");
+              for (i=0; i<n; i++)
+                fprintf(stderr, " %s", opts[i]);
+              fprintf(stderr, "\n");
+            }
+          fwrite(cmp.doc.buf, cmp.doc.len, 1, stdout);
+          return 23;
+        }
+    }
+
+  fprintf(stderr, NAME ": %lu documents identical in %d variants\n", cmp.docs, nvars);
+  for (v=vars; v<vars+nvars; v++)
+    fprintf(stderr, "\t%s/%s\t%8.2f MB/s\n", v->isa, v->mode, v->ns ? v->bytes * 1000. / v->ns : 0.);
+  return 0;
+}
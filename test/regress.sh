@@ -0,0 +1,116 @@
+#!/bin/bash
+#
+# Regression tests of json2sh
+#
+# This Works is placed under the terms of the Copyright Less License,
+# see file COPYRIGHT.CLL.  USE AT OWN RISK, ABSOLUTELY NO WARRANTY.
+#
+# Usage: test/regress.sh JSON2SH
+
+BIN="$(readlink -e "${1:-./json2sh}")" || exit 42
+TMP="$(mktemp -d)" || exit 23
+trap 'rm -rf "$TMP"' 0
+cd "$TMP" || exit 23
+
+FAILS=0
+
+# expect NAME RC STDOUT command..
+expect()
+{
+  local name="$1" rc="$2" out="$3" got ret
+  shift 3
+  got="$("$@" 2>err)"
+  ret=$?
+  if [ ".$ret" = ".$rc" ] && [ ".$got" = ".$out" ]
+  then
+	echo "ok	$name"
+  else
+	echo "FAIL	$name (exit $ret)"
+	printf '%q\n' "${got:0:200}" err: "$(head -c 200 err)"
+	FAILS=$((FAILS+1))
+  fi
+}
+
+# patch FILE OFFSET LE32
+patch32()
+{
+  printf "$(printf '\\%03o\\%03o\\%03o\\%03o' $(($3&255)) $(($3>>8&255)) $(($3>>16&255)) $(($3>>24&255)))" |
+  dd of="$1" bs=1 seek="$2" conv=notrunc status=none
+}
+
+# --diff must not trust the snapshot:  len of the first record (at 24+16) is broken
+printf '{"a":"secret","b":2}' | "$BIN" --diff snap >/dev/null
+patch32 snap 40 0x7fffffff
+expect diff-corrupt 23 '' "$BIN" --diff snap <<<'{"a":1}'
+
+# --follow continues after the first newline behind the start of a bad record,
+# even if the parser already read beyond it
+printf '{"a":1\n{"b":2}\n{"c":3}\n' >nd
+expect follow-recover 124 $'JSON__0_b=2\nJSON__0_c=3' timeout 0.5 "$BIN" --follow nd
+# and after records which exceed --max-heap, be it the name or the output
+{ printf '{"%0300000d":1}\n{"b":2}\n' 0; printf '{"a":[1%0200000d]}\n{"c":3}\n' 0; } >nd
+expect follow-heap 124 $'JSON__0_b=2\nJSON__0_c=3' timeout 2 "$BIN" --max-heap 300000 --follow nd
+
+# --raw writes escapes as UTF-8 and combines surrogate pairs
+expect raw-utf8 0 $'JSON_ s 6\n\xf0\x9f\x98\x80\xc3\xa9' "$BIN" --raw <<<'"\ud83d\ude00\u00e9"'
+
+# --reverse keeps strings which look like numbers, --numbers makes them numbers,
+# and bytes which are not UTF-8 become \u00XX
+printf '{"s":"123","k\xff":"a\xe9\xc3\xa9"}' >rev.json
+expect reverse-strings 0 '{"s":"123","k\u00ff":"a\u00e9é"}' sh -c '"$1" <rev.json | "$1" --reverse' - "$BIN"
+expect reverse-numbers 0 '{"s":123,"k\u00ff":"a\u00e9é"}' sh -c '"$1" <rev.json | "$1" --reverse --numbers' - "$BIN"
+
+# --check --stats reports like a conversion
+expect check-stats 0 '' "$BIN" --check --stats <<<'[1]'
+grep -q '^json2sh: 0 values, peak memory' err || { echo "FAIL	check-stats: $(<err)"; FAILS=$((FAILS+1)); }
+
+# --max-name counts array indexes, too
+expect max-name-index 23 'JSON__1__1__1' "$BIN" --max-name 12 <<<'[[[[1]]]]'
+expect max-name-grow 23 "$(printf 'JSON__%d_=0\n' 1 2 3 4 5 6 7 8 9)" "$BIN" --max-name 7 <<<'[0,0,0,0,0,0,0,0,0,0]'
+
+# --route keys match escapes in UTF-8
+expect route-utf8 0 'JSON__0_a=5' "$BIN" --route .é e --route .😀 s <<<'{"\u00e9":1,"é":2,"\ud83d\ude00":3,"😀":4,"a":5}'
+expect route-utf8-files 0 $'JSON__0hm_=1\nJSON__0jwlm_=2\nJSON__0IIwiIOzz_=3\nJSON__0gzmgmooz_=4' cat e s
+
+# --offload counts the bytes written, "éé" is 4 bytes
+mkdir off
+expect offload-bytes 0 "JSON_='éé'" "$BIN" --offload 4 off <<<'"éé"'
+
+# a limit of 0 is not taken as unlimited
+expect limit-zero 23 '' "$BIN" --limit-values 0 <<<'[1]'
+
+# a --listen worker which ran over --max-heap serves the next client as before
+"$BIN" --max-heap 300000 --listen sock 1 2>/dev/null &
+SRV=$!
+for a in 1 2 3 4 5 6 7 8 9 10; do [ -S sock ] && break; sleep 0.1; done
+for a in 1 2
+do
+	expect listen-heap-$a 23 '' sh -c 'printf "{\"%0300000d\":1}" 0 | "$1" --client sock >/dev/null' - "$BIN"
+	expect listen-after-$a 0 'JSON__0_a=1' "$BIN" --client sock <<<'{"a":1}'
+done
+kill $SRV
+wait
+
+# --validate-tail counts the containers which are still open for --max-depth
+expect limit-depth 23 'JSON__1__1_=1' "$BIN" --max-depth 3 --limit-values 1 --validate-tail <<<'[[1],[[[2]]]]'
+
+# --assoc and --declare give statements which bash sources
+printf '{"a":[1,"x y"],"b\\u0027":"it'"'"'s","c":{}}' >bulk.json
+expect assoc 0 "1|x y|it's|N|4" bash -c 'JSON_nothing_=N; . <("$1" --assoc 2 <bulk.json) && echo "${JSON_[_0_a_1_]}|${JSON_[_0_a_2_]}|${JSON_[_0_b_xp_]}|${JSON_[_0_c_0_]}|${#JSON_[@]}"' - "$BIN"
+expect declare 0 "1|x y|it's|N" bash -c 'JSON_nothing_=N; . <("$1" --declare 2 <bulk.json) && echo "$JSON__0_a_1_|$JSON__0_a_2_|$JSON__0_b_xp_|$JSON__0_c_0_"' - "$BIN"
+expect raw-assoc 23 '' "$BIN" --raw --assoc 0 <bulk.json
+
+# options which would do nothing are errors
+expect follow-pos-alone 23 '' "$BIN" --follow-pos pos <<<'[1]'
+expect validate-tail-alone 23 '' "$BIN" --validate-tail <<<'[1]'
+expect check-numbers 23 '' "$BIN" --check --numbers <<<'[1]'
+
+# a failed --diff run keeps the snapshot and leaves no FILE.new
+printf '{"a":1}' | "$BIN" --diff snap2 >/dev/null
+cp snap2 snap2.old
+expect diff-fail 23 '' "$BIN" --diff snap2 <<<'{"a":'
+[ ! -e snap2.new ] && cmp -s snap2 snap2.old || { echo "FAIL	diff-fail: snapshot changed or snap2.new left"; FAILS=$((FAILS+1)); }
+
+[ 0 = "$FAILS" ] && echo "all ok" && exit
+echo "$FAILS tests failed"
+exit 23